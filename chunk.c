@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "vm.h"
 
 void initChunk(Chunk* chunk) {
@@ -10,6 +11,14 @@ void initChunk(Chunk* chunk) {
 	chunk->lines = NULL;
 
 	initValueArray(&chunk->constants);
+
+	chunk->cacheCount = 0;
+	chunk->cacheCapacity = 0;
+	chunk->caches = NULL;
+
+	chunk->callCacheCount = 0;
+	chunk->callCacheCapacity = 0;
+	chunk->callCaches = NULL;
 }
 
 void writeChunk(Chunk* chunk, uint8_t byte, int line) {
@@ -29,6 +38,8 @@ void freeChunk(Chunk* chunk) {
 	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
 	FREE_ARRAY(int, chunk->lines, chunk->capacity);
 	freeValueArray(&chunk->constants);
+	FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
+	FREE_ARRAY(CallCache, chunk->callCaches, chunk->callCacheCapacity);
 	initChunk(chunk);
 }
 
@@ -41,3 +52,242 @@ int addConstant(Chunk* chunk, Value value) {
 	pop();
 	return chunk->constants.count - 1;
 }
+
+int addInlineCache(Chunk* chunk) {
+	if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+		int oldCapacity = chunk->cacheCapacity;
+		chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+		GROW_SHARED_ARRAY(InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+	}
+
+	InlineCache* cache = &chunk->caches[chunk->cacheCount];
+	for (int i = 0; i < INLINE_CACHE_SIZE; i++) {
+		cache->entries[i].klass = NULL;
+		cache->entries[i].version = 0;
+		cache->entries[i].shape = NULL;
+		cache->entries[i].fieldIndex = -1;
+		cache->entries[i].transition = NULL;
+		cache->entries[i].method = NULL;
+	}
+	cache->next = 0;
+
+	PUBLISH(chunk->cacheCount, chunk->cacheCount + 1);
+	return chunk->cacheCount - 1;
+}
+
+int addCallCache(Chunk* chunk) {
+	if (chunk->callCacheCapacity < chunk->callCacheCount + 1) {
+		int oldCapacity = chunk->callCacheCapacity;
+		chunk->callCacheCapacity = GROW_CAPACITY(oldCapacity);
+		GROW_SHARED_ARRAY(CallCache, chunk->callCaches, oldCapacity, chunk->callCacheCapacity);
+	}
+
+	CallCache* cache = &chunk->callCaches[chunk->callCacheCount];
+	cache->callee = NULL;
+	cache->kind = CALL_CLOSURE;
+	cache->closure = NULL;
+	cache->version = 0;
+
+	PUBLISH(chunk->callCacheCount, chunk->callCacheCount + 1);
+	return chunk->callCacheCount - 1;
+}
+
+/**
+ * @return size in bytes of the instruction at offset, operands included
+ */
+int instructionLength(Chunk* chunk, int offset) {
+	switch (chunk->code[offset]) {
+		case OP_CONSTANT:
+		case OP_GET_LOCAL:
+		case OP_SET_LOCAL:
+		case OP_GET_UPVALUE:
+		case OP_SET_UPVALUE:
+		case OP_CLASS:
+		case OP_METHOD:
+		case OP_GET_SUPER:
+		case OP_GET_LOCAL_CONSTANT:
+		case OP_GET_LOCAL_GET_LOCAL:
+		case OP_GET_LOCAL_CONSTANT_LESS_JUMP:
+		case OP_SET_LOCAL_POP:
+			return 2;
+		case OP_DEFINE_GLOBAL:
+		case OP_GET_GLOBAL:
+		case OP_SET_GLOBAL:
+		case OP_JUMP_IF_FALSE:
+		case OP_JUMP:
+		case OP_LOOP:
+		case OP_SUPER_INVOKE:
+		case OP_JUMP_IF_FALSE_POP:
+			return 3;
+		case OP_GET_PROPERTY:
+		case OP_SET_PROPERTY:
+		case OP_SET_PROPERTY_POP:
+		case OP_CALL:
+		case OP_TAIL_CALL:
+		case OP_CONSTANT_LONG:
+		case OP_GET_LOCAL_LONG:
+		case OP_SET_LOCAL_LONG:
+		case OP_DEFINE_GLOBAL_LONG:
+		case OP_GET_GLOBAL_LONG:
+		case OP_SET_GLOBAL_LONG:
+		case OP_CLASS_LONG:
+		case OP_METHOD_LONG:
+		case OP_GET_SUPER_LONG:
+			return 4;
+		case OP_MOVE_R:
+			return 4;
+		case OP_SUPER_INVOKE_LONG:
+			return 5;
+		case OP_GET_PROPERTY_LONG:
+		case OP_SET_PROPERTY_LONG:
+			return 6;
+		case OP_INVOKE_LONG:
+			return 7;
+		case OP_INVOKE:
+		case OP_ADD_R:
+		case OP_SUBTRACT_R:
+		case OP_MULTIPLY_R:
+		case OP_DIVIDE_R:
+		case OP_EQUAL_R:
+		case OP_GREATER_R:
+		case OP_LESS_R:
+			return 5;
+		case OP_CLOSURE: {
+			ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+			return 2 + function->upvalueCount * 2;
+		}
+		case OP_CLOSURE_LONG: {
+			uint8_t* operand = &chunk->code[offset + 1];
+			int constant = (operand[0] << 16) | (operand[1] << 8) | operand[2];
+			ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+			return 4 + function->upvalueCount * 4;
+		}
+		default:
+			return 1;
+	}
+}
+
+/**
+ * @return change of stack depth made by the instruction at offset, for
+ * OP_RETURN the value it pops; superinstructions count as their first instruction
+ */
+int stackEffect(Chunk* chunk, int offset) {
+	uint8_t* code = &chunk->code[offset];
+	switch (code[0]) {
+		case OP_CONSTANT:
+		case OP_NIL:
+		case OP_TRUE:
+		case OP_FALSE:
+		case OP_GET_GLOBAL:
+		case OP_GET_LOCAL:
+		case OP_GET_UPVALUE:
+		case OP_CLOSURE:
+		case OP_CLASS:
+		case OP_CONSTANT_LONG:
+		case OP_GET_LOCAL_LONG:
+		case OP_GET_GLOBAL_LONG:
+		case OP_CLOSURE_LONG:
+		case OP_CLASS_LONG:
+		case OP_GET_LOCAL_CONSTANT:
+		case OP_GET_LOCAL_GET_LOCAL:
+		case OP_GET_LOCAL_CONSTANT_LESS_JUMP:
+			return 1;
+		case OP_RETURN:
+		case OP_ADD:
+		case OP_SUBTRACT:
+		case OP_MULTIPLY:
+		case OP_DIVIDE:
+		case OP_EQUAL:
+		case OP_LESS:
+		case OP_GREATER:
+		case OP_PRINT:
+		case OP_POP:
+		case OP_DEFINE_GLOBAL:
+		case OP_CLOSE_UPVALUE:
+		case OP_SET_PROPERTY:
+		case OP_METHOD:
+		case OP_INHERIT:
+		case OP_GET_SUPER:
+		case OP_DEFINE_GLOBAL_LONG:
+		case OP_SET_PROPERTY_LONG:
+		case OP_METHOD_LONG:
+		case OP_GET_SUPER_LONG:
+		case OP_ADD_NUM:
+		case OP_ADD_STR:
+		case OP_EQUAL_NUM:
+		case OP_SET_PROPERTY_POP:
+			return -1;
+		case OP_CALL:
+		case OP_TAIL_CALL:
+			// callee and arguments are replaced by the result
+			return -code[1];
+		case OP_INVOKE:
+			return -code[2];
+		case OP_INVOKE_LONG:
+			return -code[4];
+		case OP_SUPER_INVOKE:
+			// the superclass is popped too
+			return -code[2] - 1;
+		case OP_SUPER_INVOKE_LONG:
+			return -code[4] - 1;
+		case OP_ADD_R:
+		case OP_SUBTRACT_R:
+		case OP_MULTIPLY_R:
+		case OP_DIVIDE_R:
+		case OP_EQUAL_R:
+		case OP_GREATER_R:
+		case OP_LESS_R:
+			return (code[2] & REG_DST_LOCAL) ? 0 : 1;
+		default:
+			return 0;
+	}
+}
+
+static bool matchSequence(Chunk* chunk, int offset, const uint8_t* ops, int count) {
+	for (int i = 0; i < count; i++) {
+		if (offset >= chunk->count || chunk->code[offset] != ops[i]) {
+			return false;
+		}
+		offset += instructionLength(chunk, offset);
+	}
+	return true;
+}
+
+/**
+ * rewrite the first opcode of frequent sequences (picked from the counts of
+ * DEBUG_PROFILE_OPCODES on the benchmark scripts) to a superinstruction.
+ * operands and the following instructions stay where they are, so jumps
+ * into the middle of a sequence still land on a valid instruction and the
+ * vm can fall back to executing the sequence one instruction at a time.
+ */
+void fuseSuperinstructions(Chunk* chunk) {
+	static const uint8_t localConstantLessJump[] = {
+		OP_GET_LOCAL, OP_CONSTANT, OP_LESS, OP_JUMP_IF_FALSE, OP_POP,
+	};
+	static const uint8_t localConstant[] = { OP_GET_LOCAL, OP_CONSTANT };
+	static const uint8_t localLocal[] = { OP_GET_LOCAL, OP_GET_LOCAL };
+	static const uint8_t setLocalPop[] = { OP_SET_LOCAL, OP_POP };
+	static const uint8_t jumpIfFalsePop[] = { OP_JUMP_IF_FALSE, OP_POP };
+	static const uint8_t setPropertyPop[] = { OP_SET_PROPERTY, OP_POP };
+
+	for (int offset = 0; offset < chunk->count;) {
+		// length of the original instruction, tail instructions get fused too
+		int length = instructionLength(chunk, offset);
+
+		if (matchSequence(chunk, offset, localConstantLessJump, 5)) {
+			chunk->code[offset] = OP_GET_LOCAL_CONSTANT_LESS_JUMP;
+		} else if (matchSequence(chunk, offset, localConstant, 2)) {
+			chunk->code[offset] = OP_GET_LOCAL_CONSTANT;
+		} else if (matchSequence(chunk, offset, localLocal, 2)) {
+			chunk->code[offset] = OP_GET_LOCAL_GET_LOCAL;
+		} else if (matchSequence(chunk, offset, setLocalPop, 2)) {
+			chunk->code[offset] = OP_SET_LOCAL_POP;
+		} else if (matchSequence(chunk, offset, jumpIfFalsePop, 2)) {
+			chunk->code[offset] = OP_JUMP_IF_FALSE_POP;
+		} else if (matchSequence(chunk, offset, setPropertyPop, 2)) {
+			chunk->code[offset] = OP_SET_PROPERTY_POP;
+		}
+
+		offset += length;
+	}
+}
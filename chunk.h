@@ -4,58 +4,154 @@
 #include "common.h"
 #include "value.h"
 
+// every opcode is listed once here, so the OpCode enum and the dispatch
+// table in vm.c are generated from the same list and can't drift apart
+#define OPCODE_LIST(X) \
+	X(OP_RETURN) \
+	X(OP_NEGATE) \
+	X(OP_ADD) \
+	X(OP_SUBTRACT) \
+	X(OP_MULTIPLY) \
+	X(OP_DIVIDE) \
+	X(OP_CONSTANT) \
+	X(OP_NIL) \
+	X(OP_TRUE) \
+	X(OP_FALSE) \
+	X(OP_NOT) \
+	X(OP_EQUAL) \
+	X(OP_LESS) \
+	X(OP_GREATER) \
+	X(OP_PRINT) \
+	X(OP_POP) \
+	X(OP_DEFINE_GLOBAL) \
+	X(OP_GET_GLOBAL) \
+	X(OP_SET_GLOBAL) \
+	X(OP_GET_LOCAL) \
+	X(OP_SET_LOCAL) \
+	X(OP_JUMP_IF_FALSE) \
+	X(OP_JUMP) \
+	X(OP_LOOP) \
+	X(OP_CALL) \
+	X(OP_TAIL_CALL) \
+	X(OP_CLOSURE) \
+	X(OP_GET_UPVALUE) \
+	X(OP_SET_UPVALUE) \
+	X(OP_CLOSE_UPVALUE) \
+	X(OP_CLASS) \
+	X(OP_GET_PROPERTY) \
+	X(OP_SET_PROPERTY) \
+	X(OP_METHOD) \
+	X(OP_INVOKE) \
+	X(OP_INHERIT) \
+	X(OP_GET_SUPER) \
+	X(OP_SUPER_INVOKE) \
+	/* long forms with a 24 bit operand, emitted only when the operand */ \
+	/* doesn't fit the short form */ \
+	X(OP_CONSTANT_LONG) \
+	X(OP_GET_LOCAL_LONG) \
+	X(OP_SET_LOCAL_LONG) \
+	X(OP_DEFINE_GLOBAL_LONG) \
+	X(OP_GET_GLOBAL_LONG) \
+	X(OP_SET_GLOBAL_LONG) \
+	/* OP_CLOSURE_LONG constant, then isLocal and a 24 bit index per upvalue */ \
+	X(OP_CLOSURE_LONG) \
+	/* name constant as a 24 bit operand, the other operands follow as in the short form */ \
+	X(OP_CLASS_LONG) \
+	X(OP_GET_PROPERTY_LONG) \
+	X(OP_SET_PROPERTY_LONG) \
+	X(OP_METHOD_LONG) \
+	X(OP_INVOKE_LONG) \
+	X(OP_GET_SUPER_LONG) \
+	X(OP_SUPER_INVOKE_LONG) \
+	/* quickened forms, only written by the vm over their generic opcode */ \
+	X(OP_ADD_NUM) \
+	X(OP_ADD_STR) \
+	X(OP_EQUAL_NUM) \
+	/* superinstructions, written by fuseSuperinstructions over the first */ \
+	/* opcode of a sequence, the rest of the sequence is left intact */ \
+	X(OP_GET_LOCAL_CONSTANT) \
+	X(OP_GET_LOCAL_GET_LOCAL) \
+	X(OP_GET_LOCAL_CONSTANT_LESS_JUMP) \
+	X(OP_SET_LOCAL_POP) \
+	X(OP_JUMP_IF_FALSE_POP) \
+	X(OP_SET_PROPERTY_POP) \
+	/* register instructions, OP_X_R dst mode b c, locals of the frame are the */ \
+	/* registers, mode selects constants for b and c and a local for dst */ \
+	X(OP_ADD_R) \
+	X(OP_SUBTRACT_R) \
+	X(OP_MULTIPLY_R) \
+	X(OP_DIVIDE_R) \
+	X(OP_EQUAL_R) \
+	X(OP_GREATER_R) \
+	X(OP_LESS_R) \
+	/* OP_MOVE_R dst mode b */ \
+	X(OP_MOVE_R)
+
+#define OPCODE_ENUM(name) name,
+
 typedef enum {
-	OP_RETURN,
-	OP_NEGATE,
-	OP_ADD,
-	OP_SUBTRACT,
-	OP_MULTIPLY,
-	OP_DIVIDE,
-	OP_CONSTANT,
-    OP_NIL,
-    OP_TRUE,
-    OP_FALSE,
-    OP_NOT,
-    OP_EQUAL,
-    OP_LESS,
-    OP_GREATER,
-    OP_PRINT,
-    OP_POP,
-    OP_DEFINE_GLOBAL,
-    OP_GET_GLOBAL,
-    OP_SET_GLOBAL,
-	OP_GET_LOCAL,
-	OP_SET_LOCAL,
-	OP_JUMP_IF_FALSE,
-	OP_JUMP,
-    OP_LOOP,
-	OP_CALL,
-	OP_CLOSURE,
-	OP_GET_UPVALUE,
-	OP_SET_UPVALUE,
-	OP_CLOSE_UPVALUE,
-	OP_CLASS,
-
-	OP_GET_PROPERTY,
-	OP_SET_PROPERTY,
-
-	OP_METHOD,
-
-	OP_INVOKE,
-
-	OP_INHERIT,
-
-	OP_GET_SUPER,
-
-	OP_SUPER_INVOKE,
+	OPCODE_LIST(OPCODE_ENUM)
 } OpCode;
 
+#undef OPCODE_ENUM
+
+typedef struct ObjClass ObjClass;
+typedef struct ObjClosure ObjClosure;
+typedef struct ObjShape ObjShape;
+
+#define INLINE_CACHE_SIZE 4
+
+// 属性访问和方法调用指令的内联缓存，以接收者的类作为key，
+// version与ObjClass.version不一致时说明类的方法表已经修改，缓存失效
+typedef struct {
+	ObjClass* klass;
+	int version;
+	// 实例shape与之相同时fieldIndex有效，-1表示该shape没有这个字段
+	ObjShape* shape;
+	int fieldIndex;
+	// 给shape添加这个字段后得到的shape
+	ObjShape* transition;
+	ObjClosure* method;
+} InlineCacheEntry;
+
+// 多态缓存，最多记录INLINE_CACHE_SIZE个类，写满后轮流替换
+typedef struct {
+	InlineCacheEntry entries[INLINE_CACHE_SIZE];
+	int next;
+} InlineCache;
+
+typedef enum {
+	CALL_CLOSURE,
+	CALL_BOUND_METHOD,
+	CALL_CLASS,
+} CallKind;
+
+// OP_CALL的单态缓存，记录上一次调用的对象和进入的闭包，调用点的参数个数不变，
+// 闭包的参数个数在填充缓存时已经检查过，再次调用同一对象时跳过类型判断和检查
+typedef struct {
+	// closure, bound method or class called last time, NULL when empty
+	Obj* callee;
+	CallKind kind;
+	// closure entered, initializer of a class, NULL for a class without one
+	ObjClosure* closure;
+	// ObjClass.version when the initializer was looked up
+	int version;
+} CallCache;
+
 typedef struct {
 	int count;
 	int capacity;
 	uint8_t* code;
 	int* lines;
 	ValueArray constants;
+
+	int cacheCount;
+	int cacheCapacity;
+	InlineCache* caches;
+
+	int callCacheCount;
+	int callCacheCapacity;
+	CallCache* callCaches;
 } Chunk;
 
 void initChunk(Chunk* chunk);
@@ -66,4 +162,29 @@ void freeChunk(Chunk* chunk);
 
 int addConstant(Chunk* chunk, Value value);
 
+int addInlineCache(Chunk* chunk);
+
+int addCallCache(Chunk* chunk);
+
+// first byte of each upvalue operand of OP_CLOSURE
+#define CAPTURE_UPVALUE 0
+#define CAPTURE_LOCAL 1
+// local never assigned after its declaration, its value is copied into the closure
+#define CAPTURE_LOCAL_VALUE 2
+
+// largest operand of the long form instructions
+#define LONG_OPERAND_MAX 0xffffff
+
+// mode operand of register instructions
+#define REG_B_CONSTANT 0x1
+#define REG_C_CONSTANT 0x2
+// result is written to local dst instead of pushed
+#define REG_DST_LOCAL 0x4
+
+int instructionLength(Chunk* chunk, int offset);
+
+int stackEffect(Chunk* chunk, int offset);
+
+void fuseSuperinstructions(Chunk* chunk);
+
 #endif
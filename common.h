@@ -9,7 +9,36 @@
 #define DEBUG_TRACE_EXECUTION
 // #define DEBUG_STRESS_GC
 #define DEBUG_LOG_GC
+// record the pause of every collection, print count, total and longest pause on exit
+// #define DEBUG_PROFILE_GC
+// count executed opcode pairs and triples, print the most frequent on exit
+// #define DEBUG_PROFILE_OPCODES
+// count hits and misses of OP_CALL call-site caches, print the hit rate on exit
+// #define DEBUG_PROFILE_CALLS
+// #define DEBUG_LOG_JIT
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// labels as values is a GNU C extension, other compilers use the switch
+// based dispatch loop in run()
+#if defined(__GNUC__) && !defined(CLOX_NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// 基线JIT生成x86-64机器码，使用mmap分配可执行页，其他平台忽略CLOX_JIT
+#if defined(CLOX_JIT) && !(defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__)))
+#undef CLOX_JIT
+#endif
+
+// 并行、并发标记和后台清除使用pthread线程和GNU C的__atomic内建函数，其他编译器在解释器线程中完成
+#if defined(PARALLEL_MARK) && !defined(__GNUC__)
+#undef PARALLEL_MARK
+#endif
+#if defined(CONCURRENT_MARK) && !defined(__GNUC__)
+#undef CONCURRENT_MARK
+#endif
+#if defined(BACKGROUND_SWEEP) && !defined(__GNUC__)
+#undef BACKGROUND_SWEEP
+#endif
+
 #endif
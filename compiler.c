@@ -53,9 +53,14 @@ typedef struct {
     Token name;
     int depth;
     bool isCaptured;
+    // assigned after its declaration, closures have to capture the stack slot
+    bool isAssigned;
+    // chunk offset where the local is declared
+    int start;
 } Local;
 
 typedef struct Upvalue {
+    // local slot or upvalue index of the enclosing function
     int index;
     bool isLocal;
 } Upvalue;
@@ -73,11 +78,19 @@ typedef struct Compiler {
     ObjFunction *function;
     FunctionType type;
 
-    Local locals[UINT8_COUNT];
+    // grows on demand, slots past UINT8_MAX are accessed with the long forms
+    Local* locals;
     int localCount;
+    int localCapacity;
     int scopeDepth;
 
     Upvalue upvalues[UINT8_COUNT];
+
+    // name constants already in the chunk, name -> constant index, each name is added once
+    Table names;
+
+    // offset of the last OP_CALL, a return value ending with it is a tail call
+    int lastCall;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -162,6 +175,35 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
 	emitByte(byte2);
 }
 
+static void emitShort(uint16_t operand) {
+	emitByte((operand >> 8) & 0xff);
+	emitByte(operand & 0xff);
+}
+
+static void emitLong(uint32_t operand) {
+	emitByte((operand >> 16) & 0xff);
+	emitByte((operand >> 8) & 0xff);
+	emitByte(operand & 0xff);
+}
+
+/**
+ * emit the short form of an instruction when operand fits in shortMax,
+ * otherwise the long form with a 24 bit operand
+ */
+static void emitOperand(uint8_t shortOp, uint8_t longOp, int operand, int shortMax) {
+	if (operand <= shortMax) {
+		emitByte(shortOp);
+		if (shortMax == UINT8_MAX) {
+			emitByte((uint8_t)operand);
+		} else {
+			emitShort((uint16_t)operand);
+		}
+	} else {
+		emitByte(longOp);
+		emitLong((uint32_t)operand);
+	}
+}
+
 static void emitLoop(int loopStart) {
     emitByte(OP_LOOP);
 
@@ -182,6 +224,70 @@ void emitReturn() {
     emitByte(OP_RETURN);
 }
 
+/**
+ * local at slot goes out of scope, if it was never assigned after its declaration
+ * closures created in its scope copy its value instead of capturing the stack slot
+ * @return true if no closure captures the stack slot
+ */
+static bool captureLocalByValue(int slot) {
+    Local* local = &current->locals[slot];
+    if (!local->isCaptured) return true;
+    if (local->isAssigned) return false;
+
+    Chunk* chunk = currentChunk();
+    for (int offset = local->start; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        uint8_t* code = chunk->code + offset;
+        if (code[0] != OP_CLOSURE && code[0] != OP_CLOSURE_LONG) continue;
+
+        bool isLong = code[0] == OP_CLOSURE_LONG;
+        int constant = isLong ? (code[1] << 16) | (code[2] << 8) | code[3] : code[1];
+        ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+        uint8_t* capture = code + (isLong ? 4 : 2);
+        for (int i = 0; i < function->upvalueCount; i++) {
+            int index = isLong ? (capture[1] << 16) | (capture[2] << 8) | capture[3] : capture[1];
+            if (capture[0] == CAPTURE_LOCAL && index == slot) {
+                capture[0] = CAPTURE_LOCAL_VALUE;
+            }
+            capture += isLong ? 4 : 2;
+        }
+    }
+    return true;
+}
+
+/**
+ * most stack slots a frame of the function takes, locals and temporaries included.
+ * the depth is the same on every path into an instruction and only OP_LOOP jumps
+ * backwards, so one pass in code order finds it, taking the depth recorded by a
+ * forward jump at its target
+ */
+static int maxStackDepth(Chunk* chunk, int arity) {
+    int* jumpDepths = ALLOCATE(int, chunk->count + 1);
+    for (int i = 0; i <= chunk->count; i++) {
+        jumpDepths[i] = -1;
+    }
+
+    // callee and arguments
+    int depth = arity + 1;
+    int maxDepth = depth;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        if (jumpDepths[offset] != -1) {
+            depth = jumpDepths[offset];
+        }
+        depth += stackEffect(chunk, offset);
+        if (depth > maxDepth) {
+            maxDepth = depth;
+        }
+
+        uint8_t* code = chunk->code + offset;
+        if (code[0] == OP_JUMP || code[0] == OP_JUMP_IF_FALSE) {
+            jumpDepths[offset + 3 + ((code[1] << 8) | code[2])] = depth;
+        }
+    }
+
+    FREE_ARRAY(int, jumpDepths, chunk->count + 1);
+    return maxDepth;
+}
+
 ObjFunction *endCompiler() {
     // generate implicit return instruction if last statement is not return statement
     Chunk* chunk = currentChunk();
@@ -191,6 +297,15 @@ ObjFunction *endCompiler() {
     }
 
     ObjFunction *function = current->function;
+    function->maxSlots = maxStackDepth(chunk, function->arity);
+    fuseSuperinstructions(chunk);
+
+    // locals of the function body are never popped by endScope
+    for (int i = 0; i < current->localCount; i++) {
+        captureLocalByValue(i);
+    }
+    FREE_ARRAY(Local, current->locals, current->localCapacity);
+    freeTable(&current->names);
 
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError)  {
@@ -246,27 +361,45 @@ static void grouping(bool canAssign) {
 	consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static uint8_t makeConstant(Value value) {
+static int makeConstant(Value value) {
 	int constant = addConstant(currentChunk(), value);
-	if (constant > UINT8_MAX) {
+	writeBarrier((Obj*)current->function, value);
+	if (constant > LONG_OPERAND_MAX) {
 		error("Too many constants in one chunk");
 		return 0;
 	}
 
-	return (uint8_t)constant;
+	return constant;
 }
 
 static void emitConstant(Value value) {
-	emitBytes(OP_CONSTANT, makeConstant(value));
+	emitOperand(OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(value), UINT8_MAX);
+}
+
+/**
+ * locals grow on demand
+ */
+static Local* pushLocal() {
+    if (current->localCount == current->localCapacity) {
+        int oldCapacity = current->localCapacity;
+        current->localCapacity = GROW_CAPACITY(oldCapacity);
+        current->locals = GROW_ARRAY(Local, current->locals, oldCapacity, current->localCapacity);
+    }
+
+    return &current->locals[current->localCount++];
 }
 
 static void initCompiler(Compiler* compiler, FunctionType type) {
     compiler->enclosing = current;
 
     compiler->function = NULL;
+    compiler->locals = NULL;
     compiler->localCount = 0;
+    compiler->localCapacity = 0;
     compiler->scopeDepth = 0;
     compiler->type = type;
+    compiler->lastCall = -1;
+    initTable(&compiler->names);
 
     // for gc
     compiler->function = newFunction();
@@ -274,10 +407,11 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     current = compiler;
     if (type != TYPE_SCRIPT) {
         current->function->name = copyString(parser.previous.start, parser.previous.length);
+        writeBarrier((Obj*)current->function, OBJ_VAL(current->function->name));
     }
 
     // compiler claims stack slot zero for internal use
-    Local* local = &current->locals[current->localCount++];
+    Local* local = pushLocal();
     local->depth = 0;
     // 第一个位置留给this使用
     if (type != TYPE_FUNCTION) {
@@ -288,6 +422,8 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
         local->name.length = 0;
     }
     local->isCaptured = false;
+    local->isAssigned = false;
+    local->start = 0;
 }
 
 static void number(bool canAssign) {
@@ -326,34 +462,186 @@ static uint8_t argumentList() {
 
 static void call(bool canAssign) {
     uint8_t argCount = argumentList();
+    current->lastCall = currentChunk()->count;
     emitBytes(OP_CALL, argCount);
+
+    int cache = addCallCache(currentChunk());
+    if (cache > UINT16_MAX) {
+        error("Too many calls in one function.");
+    }
+    emitShort((uint16_t)cache);
 }
 
-static uint8_t identifierConstant(Token* name) {
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+/**
+ * constant of a class, property or method name, instructions taking it have
+ * long forms for constants past UINT8_MAX
+ */
+static int identifierConstant(Token* name) {
+    ObjString* string = copyString(name->start, name->length);
+    Value index;
+    if (tableGet(&current->names, string, &index)) {
+        return (int)AS_NUMBER(index);
+    }
+
+    int constant = makeConstant(OBJ_VAL(string));
+    tableSet(&current->names, string, NUMBER_VAL((double)constant));
+    return constant;
+}
+
+/**
+ * resolve global variable name to its slot in vm global variables
+ */
+static int globalVariable(Token* name) {
+    int slot = globalSlot(copyString(name->start, name->length));
+    if (slot > LONG_OPERAND_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+
+    return slot;
+}
+
+/**
+ * allocate an inline cache for the property instruction just emitted,
+ * its index is encoded as a two byte operand
+ */
+static void emitInlineCache() {
+    int cache = addInlineCache(currentChunk());
+    if (cache > UINT16_MAX) {
+        error("Too many property accesses in one function.");
+    }
+
+    emitShort((uint16_t)cache);
 }
 
 static void dot(bool canAssign) {
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
 
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(OP_SET_PROPERTY, name);
+        emitOperand(OP_SET_PROPERTY, OP_SET_PROPERTY_LONG, name, UINT8_MAX);
+        emitInlineCache();
     } else if (match(TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList();
-        emitBytes(OP_INVOKE, name);
+        emitOperand(OP_INVOKE, OP_INVOKE_LONG, name, UINT8_MAX);
         emitByte(argCount);
+        emitInlineCache();
     } else {
-        emitBytes(OP_GET_PROPERTY, name);
+        emitOperand(OP_GET_PROPERTY, OP_GET_PROPERTY_LONG, name, UINT8_MAX);
+        emitInlineCache();
+    }
+}
+
+#ifdef REGISTER_BYTECODE
+// chunk offset where the left operand of the binary operator being compiled starts
+static int leftOperandStart;
+
+/**
+ * code from start to end is a single OP_GET_LOCAL or OP_CONSTANT, which reads
+ * a register operand: a local slot or a constant index
+ */
+static bool registerOperand(int start, int end, uint8_t* operand, bool* isConstant) {
+    Chunk* chunk = currentChunk();
+    if (end - start != 2) return false;
+
+    uint8_t op = chunk->code[start];
+    if (op != OP_GET_LOCAL && op != OP_CONSTANT) return false;
+
+    *operand = chunk->code[start + 1];
+    *isConstant = op == OP_CONSTANT;
+    return true;
+}
+
+/**
+ * replace the stack code of both operands with a single register instruction
+ * pushing the result, nested expressions keep the stack instructions
+ */
+static bool registerBinary(TokenType operatorType, int leftStart, int rightStart) {
+    uint8_t op;
+    bool negate = false;
+    switch (operatorType) {
+        case TOKEN_PLUS:          op = OP_ADD_R; break;
+        case TOKEN_MINUS:         op = OP_SUBTRACT_R; break;
+        case TOKEN_STAR:          op = OP_MULTIPLY_R; break;
+        case TOKEN_SLASH:         op = OP_DIVIDE_R; break;
+        case TOKEN_BANG_EQUAL:    op = OP_EQUAL_R; negate = true; break;
+        case TOKEN_EQUAL_EQUAL:   op = OP_EQUAL_R; break;
+        case TOKEN_GREATER:       op = OP_GREATER_R; break;
+        case TOKEN_GREATER_EQUAL: op = OP_LESS_R; negate = true; break;
+        case TOKEN_LESS:          op = OP_LESS_R; break;
+        case TOKEN_LESS_EQUAL:    op = OP_GREATER_R; negate = true; break;
+        default: return false;
+    }
+
+    Chunk* chunk = currentChunk();
+    uint8_t b, c;
+    bool bConstant, cConstant;
+    if (!registerOperand(leftStart, rightStart, &b, &bConstant) ||
+        !registerOperand(rightStart, chunk->count, &c, &cConstant)) {
+        return false;
+    }
+
+    chunk->count = leftStart;
+    emitBytes(op, 0);
+    emitBytes((bConstant ? REG_B_CONSTANT : 0) | (cConstant ? REG_C_CONSTANT : 0), b);
+    emitByte(c);
+    if (negate) {
+        emitByte(OP_NOT);
+    }
+    return true;
+}
+
+static bool isRegisterBinary(uint8_t op) {
+    return op == OP_ADD_R || op == OP_SUBTRACT_R || op == OP_MULTIPLY_R || op == OP_DIVIDE_R ||
+        op == OP_EQUAL_R || op == OP_GREATER_R || op == OP_LESS_R;
+}
+
+/**
+ * expression statement starting at start is an assignment to a local,
+ * write the result to the local directly instead of OP_SET_LOCAL and OP_POP
+ */
+static bool registerAssignment(int start) {
+    Chunk* chunk = currentChunk();
+    uint8_t* code = chunk->code + start;
+    int length = chunk->count - start;
+
+    // x = b op c;
+    if (length == 7 && isRegisterBinary(code[0]) && code[5] == OP_SET_LOCAL) {
+        code[1] = code[6];
+        code[2] |= REG_DST_LOCAL;
+        chunk->count = start + 5;
+        return true;
+    }
+
+    // x = b;
+    if (length == 4 && (code[0] == OP_GET_LOCAL || code[0] == OP_CONSTANT) && code[2] == OP_SET_LOCAL) {
+        uint8_t mode = REG_DST_LOCAL | (code[0] == OP_CONSTANT ? REG_B_CONSTANT : 0);
+        uint8_t b = code[1];
+        uint8_t dst = code[3];
+        chunk->count = start;
+        emitBytes(OP_MOVE_R, dst);
+        emitBytes(mode, b);
+        return true;
     }
+
+    return false;
 }
+#endif
 
 static void binary(bool canAssign) {
   TokenType operatorType = parser.previous.type;
   ParseRule* rule = getRule(operatorType);
+#ifdef REGISTER_BYTECODE
+  int leftStart = leftOperandStart;
+  int rightStart = currentChunk()->count;
+#endif
   parsePrecedence((Precedence)(rule->precedence + 1));
 
+#ifdef REGISTER_BYTECODE
+  if (registerBinary(operatorType, leftStart, rightStart)) return;
+#endif
+
   switch (operatorType) {
     case TOKEN_PLUS:          emitByte(OP_ADD); break;
     case TOKEN_MINUS:         emitByte(OP_SUBTRACT); break;
@@ -404,7 +692,7 @@ static int resolveLocal(Compiler* compiler, Token* name) {
     return LOCAL_VARIABLE_NOT_FOUND;
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Compiler* compiler, int index, bool isLocal) {
     int upvalueCount = compiler->function->upvalueCount;
 
     for (int i = 0; i < upvalueCount; i++) {
@@ -433,39 +721,63 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
     int local = resolveLocal(compiler->enclosing, name);
     if (local != -1) {
         compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t)local, true);
+        return addUpvalue(compiler, local, true);
     }
 
     int upvalue = resolveUpvalue(compiler->enclosing, name);
     if (upvalue != -1) {
-        return addUpvalue(compiler, (uint8_t)upvalue, false);
+        return addUpvalue(compiler, upvalue, false);
     }
 
     return -1;
 }
 
+// assignment through an upvalue, the local it refers to can't be captured by value
+static void markUpvalueAssigned(Compiler* compiler, int index) {
+    Upvalue* upvalue = &compiler->upvalues[index];
+    if (upvalue->isLocal) {
+        compiler->enclosing->locals[upvalue->index].isAssigned = true;
+    } else {
+        markUpvalueAssigned(compiler->enclosing, upvalue->index);
+    }
+}
+
 // 解析变量名，生成对应的读写指令
 static void namedVariable(Token token, bool canAssign) {
     int arg = resolveLocal(current, &token);
-    uint8_t getOp, setOp;
+    uint8_t getOp, setOp, getLongOp, setLongOp;
+    // global slot takes a two byte operand
+    int shortMax = UINT8_MAX;
     // find no local variable of name token, so it's a global variable
     if (arg != LOCAL_VARIABLE_NOT_FOUND) {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
+        getLongOp = OP_GET_LOCAL_LONG;
+        setLongOp = OP_SET_LOCAL_LONG;
     // local variable
     } else if ((arg = resolveUpvalue(current, &token)) != -1) {
-        getOp = OP_GET_UPVALUE;
-        setOp = OP_SET_UPVALUE;
+        // upvalue count is limited to UINT8_COUNT, there's no long form
+        getOp = getLongOp = OP_GET_UPVALUE;
+        setOp = setLongOp = OP_SET_UPVALUE;
     } else {
-        arg = identifierConstant(&token);
+        arg = globalVariable(&token);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
+        getLongOp = OP_GET_GLOBAL_LONG;
+        setLongOp = OP_SET_GLOBAL_LONG;
+        shortMax = UINT16_MAX;
     }
+
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(setOp, arg);
+        if (getOp == OP_GET_LOCAL) {
+            current->locals[arg].isAssigned = true;
+        } else if (getOp == OP_GET_UPVALUE) {
+            markUpvalueAssigned(current, arg);
+        }
+        emitOperand(setOp, setLongOp, arg, shortMax);
     } else {
-        emitBytes(getOp, arg);
+        emitOperand(getOp, getLongOp, arg, shortMax);
     }
 }
 
@@ -498,17 +810,17 @@ static void super_(bool canAssign) {
 
     consume(TOKEN_DOT, "Expect '.' after 'super'.");
     consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
 
     namedVariable(syntheticToken("this"), false);
     if (match(TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList();
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_SUPER_INVOKE, name);
+        emitOperand(OP_SUPER_INVOKE, OP_SUPER_INVOKE_LONG, name, UINT8_MAX);
         emitByte(argCount);
     } else {
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_GET_SUPER, name);
+        emitOperand(OP_GET_SUPER, OP_GET_SUPER_LONG, name, UINT8_MAX);
     }
 }
 
@@ -585,10 +897,16 @@ static void parsePrecedence(Precedence precedence) {
     }
 
     bool canAssign = precedence <= PREC_ASSIGNMENT;
+#ifdef REGISTER_BYTECODE
+    int start = currentChunk()->count;
+#endif
     prefixRule(canAssign);
     while (precedence <= getRule(parser.current.type)->precedence) {
         advance();
         ParseFn infixRule = getRule(parser.previous.type)->infix;
+#ifdef REGISTER_BYTECODE
+        leftOperandStart = start;
+#endif
         infixRule(canAssign);
     }
 
@@ -599,18 +917,18 @@ static void parsePrecedence(Precedence precedence) {
 
 static void addLocal(Token name) {
     // report an error if total local count exceeds limit
-    if (current->localCount == UINT8_COUNT) {
+    if (current->localCount > LONG_OPERAND_MAX) {
         error("Too many local variables in function.");
         return;
     }
 
-    Local* variable = &current->locals[current->localCount];
+    Local* variable = pushLocal();
     variable->name = name;
     // mark local variable as uninitialized using depth
     variable->depth = LOCAL_VARIABLE_UNINITIALIZED;
     variable->isCaptured = false;
-
-    current->localCount++;
+    variable->isAssigned = false;
+    variable->start = currentChunk()->count;
 }
 
 static void markInitialized() {
@@ -643,21 +961,21 @@ static void declareVariable() {
     addLocal(*name);
 }
 
-static uint8_t parseVariable(const char* message) {
+static int parseVariable(const char* message) {
     consume(TOKEN_IDENTIFIER, message);
 
     declareVariable();
 
-    // don't generate constant string for local variable name
+    // don't allocate global slot for local variable name
     bool isLocalVariable = current->scopeDepth > 0;
     if (isLocalVariable) return 0;
-    return identifierConstant(&parser.previous);
+    return globalVariable(&parser.previous);
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
     // skip local variable
     if (current->scopeDepth > 0) { markInitialized(); return; }
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitOperand(OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global, UINT16_MAX);
 }
 
 static ParseRule* getRule(TokenType type) {
@@ -724,7 +1042,7 @@ static void synchronize() {
 }
 
 static void varDeclaration() {
-    uint32_t global = parseVariable("Expect variable name");
+    int global = parseVariable("Expect variable name");
 
     if (match(TOKEN_EQUAL)) {
         expression();
@@ -762,8 +1080,14 @@ static void whileStatement() {
 }
 
 static void expressionStatement() {
+#ifdef REGISTER_BYTECODE
+    int start = currentChunk()->count;
+#endif
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after value");
+#ifdef REGISTER_BYTECODE
+    if (registerAssignment(start)) return;
+#endif
     emitByte(OP_POP);
 }
 
@@ -780,7 +1104,7 @@ static void endScope() {
         if (current->locals[i].depth < current->scopeDepth) {
             break;
         }
-        if (current->locals[current->localCount - 1].isCaptured) {
+        if (!captureLocalByValue(current->localCount - 1)) {
             emitByte(OP_CLOSE_UPVALUE);
         } else {
             emitByte(OP_POP);
@@ -842,7 +1166,7 @@ static void function(FunctionType type) {
             if (current->function->arity > 255) {
                 errorAtCurrent("Can't have more than 255 parameters");
             }
-            uint8_t constant = parseVariable("Expect parameter name");
+            int constant = parseVariable("Expect parameter name");
             // TODO: not need to define ?
             defineVariable(constant);
         } while (match(TOKEN_COMMA));
@@ -854,17 +1178,40 @@ static void function(FunctionType type) {
 
     ObjFunction* function = endCompiler();
 
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    int constant = makeConstant(OBJ_VAL(function));
     // emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(newClosure(function))));
 
+    // captured locals past UINT8_MAX also need the long form
+    bool isLong = constant > UINT8_MAX;
+    for (int i = 0; i < function->upvalueCount; i++) {
+        if (compiler.upvalues[i].index > UINT8_MAX) {
+            isLong = true;
+        }
+        // a local function capturing itself is captured before the closure is stored in its slot
+        if (type == TYPE_FUNCTION && current->scopeDepth > 0 &&
+            compiler.upvalues[i].isLocal && compiler.upvalues[i].index == current->localCount - 1) {
+            current->locals[compiler.upvalues[i].index].isAssigned = true;
+        }
+    }
+
+    if (isLong) {
+        emitByte(OP_CLOSURE_LONG);
+        emitLong((uint32_t)constant);
+    } else {
+        emitBytes(OP_CLOSURE, (uint8_t)constant);
+    }
     for (int i = 0; i < function->upvalueCount; i++) {
-        emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(compiler.upvalues[i].index);
+        emitByte(compiler.upvalues[i].isLocal ? CAPTURE_LOCAL : CAPTURE_UPVALUE);
+        if (isLong) {
+            emitLong((uint32_t)compiler.upvalues[i].index);
+        } else {
+            emitByte((uint8_t)compiler.upvalues[i].index);
+        }
     }
 }
 
 static void funDeclaration() {
-    uint8_t global = parseVariable("Expect function name.");
+    int global = parseVariable("Expect function name.");
     markInitialized();
     function(TYPE_FUNCTION);
     defineVariable(global);
@@ -872,7 +1219,7 @@ static void funDeclaration() {
 
 static void method() {
     consume(TOKEN_IDENTIFIER, "Expect method name");
-    uint8_t constant = identifierConstant(&parser.previous);
+    int constant = identifierConstant(&parser.previous);
 
     FunctionType type = TYPE_METHOD;
     if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) {
@@ -880,18 +1227,18 @@ static void method() {
     }
 
     function(type);
-    emitBytes(OP_METHOD, constant);
+    emitOperand(OP_METHOD, OP_METHOD_LONG, constant, UINT8_MAX);
 }
 
 static void classDeclaration() {
     consume(TOKEN_IDENTIFIER, "Expect class name.");
     Token className = parser.previous;
-    uint8_t constant = identifierConstant(&parser.previous);
+    int constant = identifierConstant(&parser.previous);
 
     declareVariable();
 
-    emitBytes(OP_CLASS, constant);
-    defineVariable(constant);
+    emitOperand(OP_CLASS, OP_CLASS_LONG, constant, UINT8_MAX);
+    defineVariable(current->scopeDepth > 0 ? 0 : globalVariable(&className));
 
     ClassCompiler classCompiler;
     classCompiler.enclosing = currentClass;
@@ -964,6 +1311,11 @@ static void returnStatement() {
 
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value");
+        // return f(...); reuses the frame of current function
+        Chunk* chunk = currentChunk();
+        if (current->lastCall != -1 && current->lastCall == chunk->count - 4) {
+            chunk->code[current->lastCall] = OP_TAIL_CALL;
+        }
         emitByte(OP_RETURN);
     }
 }
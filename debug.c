@@ -1,6 +1,8 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include "debug.h"
 #include "object.h"
+#include "vm.h"
 
 static int simpleInstruction(const char* name, int offset) {
 	printf("%s\n", name);
@@ -18,12 +20,62 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
 	return offset + 2;
 }
 
+static int globalInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    printf("%-16s %4d '", name, slot);
+    printValue(vm.globalNames.values[slot]);
+    printf("'\n");
+    return offset + 3;
+}
+
+static uint32_t readLong(Chunk* chunk, int offset) {
+    return (uint32_t)((chunk->code[offset] << 16) | (chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+}
+
+static int constantLongInstruction(const char* name, Chunk* chunk, int offset) {
+    uint32_t constant = readLong(chunk, offset + 1);
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
+static int globalLongInstruction(const char* name, Chunk* chunk, int offset) {
+    uint32_t slot = readLong(chunk, offset + 1);
+    printf("%-16s %4d '", name, slot);
+    printValue(vm.globalNames.values[slot]);
+    printf("'\n");
+    return offset + 4;
+}
+
+static int longInstruction(const char* name, Chunk* chunk, int offset) {
+    printf("%-16s %4d\n", name, readLong(chunk, offset + 1));
+    return offset + 4;
+}
+
+static const char* captureName(int capture) {
+    switch (capture) {
+        case CAPTURE_LOCAL: return "local";
+        case CAPTURE_LOCAL_VALUE: return "value";
+        default: return "upvalue";
+    }
+}
+
 static int byteInstruction(const char* name, Chunk* chunk, int offset) {
     uint8_t slot = chunk->code[offset + 1];
     printf("%-16s %4d\n", name, slot);
     return offset + 2;
 }
 
+static int callInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t argCount = chunk->code[offset + 1];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+    cache |= chunk->code[offset + 3];
+    printf("%-16s (%d args) cache %d\n", name, argCount, cache);
+    return offset + 4;
+}
+
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
     jump |= chunk->code[offset + 2];
@@ -42,6 +94,86 @@ static int invokeInstruction(const char* name, Chunk* chunk,
   return offset + 3;
 }
 
+static int invokeLongInstruction(const char* name, Chunk* chunk, int offset) {
+  uint32_t constant = readLong(chunk, offset + 1);
+  uint8_t argCount = chunk->code[offset + 4];
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 5;
+}
+
+static int propertyLongInstruction(const char* name, Chunk* chunk, int offset) {
+  uint32_t constant = readLong(chunk, offset + 1);
+  uint16_t cache = (uint16_t)(chunk->code[offset + 4] << 8);
+  cache |= chunk->code[offset + 5];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' cache %d\n", cache);
+  return offset + 6;
+}
+
+static int propertyInstruction(const char* name, Chunk* chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+  cache |= chunk->code[offset + 3];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' cache %d\n", cache);
+  return offset + 4;
+}
+
+static void printRegisterOperand(Chunk* chunk, uint8_t operand, bool isConstant) {
+  if (isConstant) {
+    printf(" k%d '", operand);
+    printValue(chunk->constants.values[operand]);
+    printf("'");
+  } else {
+    printf(" r%d", operand);
+  }
+}
+
+// OP_X_R dst mode b c, OP_MOVE_R dst mode b
+static int registerInstruction(const char* name, Chunk* chunk, int offset, bool binary) {
+  uint8_t dst = chunk->code[offset + 1];
+  uint8_t mode = chunk->code[offset + 2];
+  printf("%-16s ", name);
+  if (mode & REG_DST_LOCAL) {
+    printf("r%d <-", dst);
+  } else {
+    printf("push <-");
+  }
+  printRegisterOperand(chunk, chunk->code[offset + 3], mode & REG_B_CONSTANT);
+  if (binary) {
+    printRegisterOperand(chunk, chunk->code[offset + 4], mode & REG_C_CONSTANT);
+  }
+  printf("\n");
+  return offset + (binary ? 5 : 4);
+}
+
+static int cachedInvokeInstruction(const char* name, Chunk* chunk,
+                                int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint8_t argCount = chunk->code[offset + 2];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+  cache |= chunk->code[offset + 4];
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' cache %d\n", cache);
+  return offset + 5;
+}
+
+static int cachedInvokeLongInstruction(const char* name, Chunk* chunk, int offset) {
+  uint32_t constant = readLong(chunk, offset + 1);
+  uint8_t argCount = chunk->code[offset + 4];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 5] << 8);
+  cache |= chunk->code[offset + 6];
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' cache %d\n", cache);
+  return offset + 7;
+}
+
 int disassembleInstruction(Chunk* chunk, int offset) {
 	// print bytecode offset
 	printf("%04d ", offset);
@@ -63,6 +195,10 @@ int disassembleInstruction(Chunk* chunk, int offset) {
 			return constantInstruction("OP_CONSTANT", chunk, offset);
 		case OP_ADD:
 			return simpleInstruction("OP_ADD", offset);
+		case OP_ADD_NUM:
+			return simpleInstruction("OP_ADD_NUM", offset);
+		case OP_ADD_STR:
+			return simpleInstruction("OP_ADD_STR", offset);
 		case OP_SUBTRACT:
 			return simpleInstruction("OP_SUBTRACT", offset);
 		case OP_MULTIPLY:
@@ -79,6 +215,8 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_NOT", offset);
         case OP_EQUAL:
             return simpleInstruction("OP_EQUAL", offset);
+        case OP_EQUAL_NUM:
+            return simpleInstruction("OP_EQUAL_NUM", offset);
         case OP_GREATER:
             return simpleInstruction("OP_GREATER", offset);
         case OP_LESS:
@@ -88,18 +226,45 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_POP:
             return simpleInstruction("OP_POP", offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk,
+            return globalInstruction("OP_DEFINE_GLOBAL", chunk,
                                        offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_GET_GLOBAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_SET_GLOBAL", chunk, offset);
 
         case OP_GET_LOCAL:
             return byteInstruction("OP_GET_LOCAL", chunk, offset);
         case OP_SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL", chunk, offset);
 
+        case OP_CONSTANT_LONG:
+            return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
+        case OP_DEFINE_GLOBAL_LONG:
+            return globalLongInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+        case OP_GET_GLOBAL_LONG:
+            return globalLongInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
+        case OP_SET_GLOBAL_LONG:
+            return globalLongInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
+        case OP_GET_LOCAL_LONG:
+            return longInstruction("OP_GET_LOCAL_LONG", chunk, offset);
+        case OP_SET_LOCAL_LONG:
+            return longInstruction("OP_SET_LOCAL_LONG", chunk, offset);
+        case OP_CLASS_LONG:
+            return constantLongInstruction("OP_CLASS_LONG", chunk, offset);
+        case OP_METHOD_LONG:
+            return constantLongInstruction("OP_METHOD_LONG", chunk, offset);
+        case OP_GET_PROPERTY_LONG:
+            return propertyLongInstruction("OP_GET_PROPERTY_LONG", chunk, offset);
+        case OP_SET_PROPERTY_LONG:
+            return propertyLongInstruction("OP_SET_PROPERTY_LONG", chunk, offset);
+        case OP_INVOKE_LONG:
+            return cachedInvokeLongInstruction("OP_INVOKE_LONG", chunk, offset);
+        case OP_GET_SUPER_LONG:
+            return constantLongInstruction("OP_GET_SUPER_LONG", chunk, offset);
+        case OP_SUPER_INVOKE_LONG:
+            return invokeLongInstruction("OP_SUPER_INVOKE_LONG", chunk, offset);
+
         case OP_JUMP:
             return jumpInstruction("OP_JUMP", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
@@ -109,7 +274,9 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
 
         case OP_CALL:
-            return byteInstruction("OP_CALL", chunk, offset);
+            return callInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return callInstruction("OP_TAIL_CALL", chunk, offset);
         case OP_CLOSURE: {
             offset++;
             uint8_t constant = chunk->code[offset++];
@@ -119,9 +286,26 @@ int disassembleInstruction(Chunk* chunk, int offset) {
 
             ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
             for (int i = 0; i < function->upvalueCount; i++) {
-                int isLocal = chunk->code[offset++];
+                int capture = chunk->code[offset++];
                 int index = chunk->code[offset++];
-                printf("%04d      |                     %s %d\n", offset - 2, isLocal ? "local" : "upvalue", index);
+                printf("%04d      |                     %s %d\n", offset - 2, captureName(capture), index);
+            }
+
+            return offset;
+        }
+        case OP_CLOSURE_LONG: {
+            uint32_t constant = readLong(chunk, offset + 1);
+            offset += 4;
+            printf("%-16s %4d", "OP_CLOSURE_LONG", constant);
+            printValue(chunk->constants.values[constant]);
+            printf("\n");
+
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+            for (int i = 0; i < function->upvalueCount; i++) {
+                int capture = chunk->code[offset];
+                uint32_t index = readLong(chunk, offset + 1);
+                printf("%04d      |                     %s %d\n", offset, captureName(capture), index);
+                offset += 4;
             }
 
             return offset;
@@ -141,11 +325,43 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return constantInstruction("OP_METHOD", chunk, offset);
 
         case OP_GET_PROPERTY:
-            return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
         case OP_SET_PROPERTY:
-            return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
         case OP_INVOKE:
-            return invokeInstruction("OP_INVOKE", chunk, offset);
+            return cachedInvokeInstruction("OP_INVOKE", chunk, offset);
+
+        case OP_ADD_R:
+            return registerInstruction("OP_ADD_R", chunk, offset, true);
+        case OP_SUBTRACT_R:
+            return registerInstruction("OP_SUBTRACT_R", chunk, offset, true);
+        case OP_MULTIPLY_R:
+            return registerInstruction("OP_MULTIPLY_R", chunk, offset, true);
+        case OP_DIVIDE_R:
+            return registerInstruction("OP_DIVIDE_R", chunk, offset, true);
+        case OP_EQUAL_R:
+            return registerInstruction("OP_EQUAL_R", chunk, offset, true);
+        case OP_GREATER_R:
+            return registerInstruction("OP_GREATER_R", chunk, offset, true);
+        case OP_LESS_R:
+            return registerInstruction("OP_LESS_R", chunk, offset, true);
+        case OP_MOVE_R:
+            return registerInstruction("OP_MOVE_R", chunk, offset, false);
+
+        // superinstructions only cover the first instruction of the sequence,
+        // the rest is still in place and disassembled as usual
+        case OP_GET_LOCAL_CONSTANT:
+            return byteInstruction("OP_GET_LOCAL_CONSTANT", chunk, offset);
+        case OP_GET_LOCAL_GET_LOCAL:
+            return byteInstruction("OP_GET_LOCAL_GET_LOCAL", chunk, offset);
+        case OP_GET_LOCAL_CONSTANT_LESS_JUMP:
+            return byteInstruction("OP_GET_LOCAL_CONSTANT_LESS_JUMP", chunk, offset);
+        case OP_SET_LOCAL_POP:
+            return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+        case OP_JUMP_IF_FALSE_POP:
+            return jumpInstruction("OP_JUMP_IF_FALSE_POP", 1, chunk, offset);
+        case OP_SET_PROPERTY_POP:
+            return propertyInstruction("OP_SET_PROPERTY_POP", chunk, offset);
 
         case OP_INHERIT:
             return simpleInstruction("OP_INHERIT", offset);
@@ -167,3 +383,95 @@ void disassembleChunk(Chunk* chunk, const char* name) {
 		offset = disassembleInstruction(chunk, offset);
 	}
 }
+
+#ifdef DEBUG_PROFILE_OPCODES
+
+#define OPCODE_NAME(name) #name,
+static const char* opcodeNames[] = {
+    OPCODE_LIST(OPCODE_NAME)
+};
+#undef OPCODE_NAME
+
+#define OPCODE_COUNT ((int)(sizeof(opcodeNames) / sizeof(opcodeNames[0])))
+#define PROFILE_TOP 20
+
+static uint64_t instructionCount;
+static uint64_t pairCounts[OPCODE_COUNT][OPCODE_COUNT];
+static uint64_t tripleCounts[OPCODE_COUNT][OPCODE_COUNT][OPCODE_COUNT];
+static int previous1 = -1;
+static int previous2 = -1;
+
+void profileInstruction(uint8_t instruction) {
+    instructionCount++;
+    if (previous1 != -1) {
+        pairCounts[previous1][instruction]++;
+        if (previous2 != -1) {
+            tripleCounts[previous2][previous1][instruction]++;
+        }
+    }
+    previous2 = previous1;
+    previous1 = instruction;
+}
+
+typedef struct {
+    uint64_t count;
+    int ops[3];
+} Sequence;
+
+static int compareSequence(const void* a, const void* b) {
+    uint64_t left = ((const Sequence*)a)->count;
+    uint64_t right = ((const Sequence*)b)->count;
+    return left < right ? 1 : (left > right ? -1 : 0);
+}
+
+static void printTop(Sequence* sequences, int count, int length) {
+    qsort(sequences, count, sizeof(Sequence), compareSequence);
+    for (int i = 0; i < count && i < PROFILE_TOP && sequences[i].count > 0; i++) {
+        fprintf(stderr, "%12llu ", (unsigned long long)sequences[i].count);
+        for (int j = 0; j < length; j++) {
+            fprintf(stderr, " %s", opcodeNames[sequences[i].ops[j]]);
+        }
+        fprintf(stderr, "\n");
+    }
+}
+
+void printOpcodeProfile() {
+    int count = OPCODE_COUNT * OPCODE_COUNT * OPCODE_COUNT;
+    Sequence* sequences = malloc(sizeof(Sequence) * count);
+    if (sequences == NULL) {
+        return;
+    }
+
+    fprintf(stderr, "== %llu instructions ==\n", (unsigned long long)instructionCount);
+
+    int n = 0;
+    for (int a = 0; a < OPCODE_COUNT; a++) {
+        for (int b = 0; b < OPCODE_COUNT; b++) {
+            sequences[n].count = pairCounts[a][b];
+            sequences[n].ops[0] = a;
+            sequences[n].ops[1] = b;
+            n++;
+        }
+    }
+    fprintf(stderr, "== opcode pairs ==\n");
+    printTop(sequences, n, 2);
+
+    n = 0;
+    for (int a = 0; a < OPCODE_COUNT; a++) {
+        for (int b = 0; b < OPCODE_COUNT; b++) {
+            for (int c = 0; c < OPCODE_COUNT; c++) {
+                sequences[n].count = tripleCounts[a][b][c];
+                sequences[n].ops[0] = a;
+                sequences[n].ops[1] = b;
+                sequences[n].ops[2] = c;
+                n++;
+            }
+        }
+    }
+    fprintf(stderr, "== opcode triples ==\n");
+    printTop(sequences, n, 3);
+
+    free(sequences);
+}
+
+#endif
@@ -6,4 +6,9 @@
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
 
+#ifdef DEBUG_PROFILE_OPCODES
+void profileInstruction(uint8_t instruction);
+void printOpcodeProfile();
+#endif
+
 #endif
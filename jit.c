@@ -0,0 +1,788 @@
+#include "common.h"
+
+#ifdef CLOX_JIT
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "chunk.h"
+#include "jit.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+/**
+ * 基线模板JIT，每条字节码指令翻译为一段固定的x86-64机器码，不做寄存器分配，
+ * 值栈仍然在vm.stack中，和解释器共用CallFrame。
+ *
+ * 机器码只处理不会切换栈帧的指令，数字运算只有快速路径，实例字段读写调用vm.c中的函数。
+ * 遇到调用、返回、属性访问等指令或者类型检查失败时写回ip和栈顶后返回解释器（side exit），
+ * 由解释器执行这条指令，包括报告运行时错误，所以printStackTrace看到的ip总是准确的。
+ * 解释器在调用、返回和循环回跳之后重新进入机器码。
+ *
+ * 寄存器约定
+ * rbx  当前帧的slots
+ * r12  栈顶stackTop
+ * r13  常量表constants
+ * r14  CallFrame*
+ * r15  只用于对齐栈，调用C函数时rsp按16字节对齐
+ * rax rcx rdx xmm0 xmm1 临时寄存器
+ */
+
+typedef void (*JitEntry)(CallFrame* frame, Value* stackTop, Value* constants, uint8_t* target);
+
+enum {
+    RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+    R12 = 12, R13 = 13, R14 = 14, R15 = 15,
+};
+
+// condition codes of jcc/setcc
+enum {
+    CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7, CC_NP = 0xb,
+};
+
+#define VALUE_SIZE ((int32_t)sizeof(Value))
+
+#ifdef NAN_BOXING
+#define NUMBER_OFFSET 0
+#else
+#define NUMBER_OFFSET ((int32_t)offsetof(Value, as))
+#endif
+
+typedef struct {
+    // position of the rel32 to patch
+    int at;
+    // bytecode offset it jumps or exits to
+    int target;
+} Fixup;
+
+typedef struct {
+    uint8_t* code;
+    int count;
+    int capacity;
+
+    // jumps to bytecode targets, patched after all instructions are emitted
+    Fixup* jumps;
+    int jumpCount;
+    int jumpCapacity;
+
+    // conditional side exits, stubs are emitted after all instructions
+    Fixup* exits;
+    int exitCount;
+    int exitCapacity;
+
+    int epilogue;
+    Chunk* chunk;
+} Assembler;
+
+static void emitByte(Assembler* as, uint8_t byte) {
+    if (as->count == as->capacity) {
+        as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+        as->code = realloc(as->code, as->capacity);
+        if (as->code == NULL) exit(1);
+    }
+    as->code[as->count++] = byte;
+}
+
+static void emitBytes(Assembler* as, int count, ...) {
+    va_list args;
+    va_start(args, count);
+    for (int i = 0; i < count; i++) {
+        emitByte(as, (uint8_t)va_arg(args, int));
+    }
+    va_end(args);
+}
+
+static void emitInt32(Assembler* as, int32_t value) {
+    uint32_t bits = (uint32_t)value;
+    for (int i = 0; i < 4; i++) {
+        emitByte(as, (uint8_t)(bits >> (i * 8)));
+    }
+}
+
+static void emitInt64(Assembler* as, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        emitByte(as, (uint8_t)(value >> (i * 8)));
+    }
+}
+
+static void patchInt32(Assembler* as, int at, int32_t value) {
+    uint32_t bits = (uint32_t)value;
+    for (int i = 0; i < 4; i++) {
+        as->code[at + i] = (uint8_t)(bits >> (i * 8));
+    }
+}
+
+static void addFixup(Fixup** fixups, int* count, int* capacity, int at, int target) {
+    if (*count == *capacity) {
+        *capacity = *capacity < 8 ? 8 : *capacity * 2;
+        *fixups = realloc(*fixups, sizeof(Fixup) * *capacity);
+        if (*fixups == NULL) exit(1);
+    }
+    (*fixups)[*count].at = at;
+    (*fixups)[*count].target = target;
+    (*count)++;
+}
+
+// REX prefix, w selects 64 bit operand size, reg and base above 7 need the extension bits
+static void emitRex(Assembler* as, bool w, int reg, int base) {
+    uint8_t rex = 0x40 | (w ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((base & 8) ? 0x01 : 0);
+    if (rex != 0x40) {
+        emitByte(as, rex);
+    }
+}
+
+// ModRM for [base + disp32], rsp and r12 as base need a SIB byte
+static void emitMemory(Assembler* as, int reg, int base, int32_t disp) {
+    emitByte(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) {
+        emitByte(as, 0x24);
+    }
+    emitInt32(as, disp);
+}
+
+// mov reg, [base + disp]
+static void emitLoad(Assembler* as, int reg, int base, int32_t disp) {
+    emitRex(as, true, reg, base);
+    emitByte(as, 0x8b);
+    emitMemory(as, reg, base, disp);
+}
+
+// mov [base + disp], reg
+static void emitStore(Assembler* as, int base, int32_t disp, int reg) {
+    emitRex(as, true, reg, base);
+    emitByte(as, 0x89);
+    emitMemory(as, reg, base, disp);
+}
+
+// mov dst, src
+static void emitMove(Assembler* as, int dst, int src) {
+    emitRex(as, true, src, dst);
+    emitByte(as, 0x89);
+    emitByte(as, 0xc0 | ((src & 7) << 3) | (dst & 7));
+}
+
+// mov reg, imm64
+static void emitMoveImmediate(Assembler* as, int reg, uint64_t value) {
+    emitRex(as, true, 0, reg);
+    emitByte(as, 0xb8 + (reg & 7));
+    emitInt64(as, value);
+}
+
+// add reg, imm32
+static void emitAddImmediate(Assembler* as, int reg, int32_t value) {
+    emitRex(as, true, 0, reg);
+    emitByte(as, 0x81);
+    emitByte(as, 0xc0 | (reg & 7));
+    emitInt32(as, value);
+}
+
+#ifdef NAN_BOXING
+// cmp a, b
+static void emitCompare(Assembler* as, int a, int b) {
+    emitRex(as, true, b, a);
+    emitByte(as, 0x39);
+    emitByte(as, 0xc0 | ((b & 7) << 3) | (a & 7));
+}
+#else
+// cmp dword [base + disp], imm32
+static void emitCompareInt32(Assembler* as, int base, int32_t disp, int32_t value) {
+    emitRex(as, false, 0, base);
+    emitByte(as, 0x81);
+    emitMemory(as, 7, base, disp);
+    emitInt32(as, value);
+}
+#endif
+
+// SSE instruction with xmm register and [base + disp] operand
+static void emitSse(Assembler* as, uint8_t prefix, uint8_t opcode, int xmm, int base, int32_t disp) {
+    emitByte(as, prefix);
+    emitRex(as, false, xmm, base);
+    emitByte(as, 0x0f);
+    emitByte(as, opcode);
+    emitMemory(as, xmm, base, disp);
+}
+
+// setcc reg8, only al cl dl
+static void emitSet(Assembler* as, uint8_t cc, int reg) {
+    emitByte(as, 0x0f);
+    emitByte(as, 0x90 + cc);
+    emitByte(as, 0xc0 | reg);
+}
+
+// jcc rel32 to a side exit at bytecode offset
+static void emitExitIf(Assembler* as, uint8_t cc, int offset) {
+    emitByte(as, 0x0f);
+    emitByte(as, 0x80 + cc);
+    addFixup(&as->exits, &as->exitCount, &as->exitCapacity, as->count, offset);
+    emitInt32(as, 0);
+}
+
+// write back ip of the instruction at offset and return to the interpreter
+static void emitExit(Assembler* as, int offset) {
+    emitMoveImmediate(as, RAX, (uint64_t)(uintptr_t)(as->chunk->code + offset));
+    emitByte(as, 0xe9);
+    emitInt32(as, as->epilogue - (as->count + 4));
+}
+
+// jmp or jcc rel32 to the machine code of bytecode offset
+static void emitJump(Assembler* as, int cc, int target) {
+    if (cc < 0) {
+        emitByte(as, 0xe9);
+    } else {
+        emitByte(as, 0x0f);
+        emitByte(as, 0x80 + cc);
+    }
+    addFixup(&as->jumps, &as->jumpCount, &as->jumpCapacity, as->count, target);
+    emitInt32(as, 0);
+}
+
+static void emitCopyValue(Assembler* as, int dstBase, int32_t dstDisp, int srcBase, int32_t srcDisp) {
+#ifdef NAN_BOXING
+    emitLoad(as, RAX, srcBase, srcDisp);
+    emitStore(as, dstBase, dstDisp, RAX);
+#else
+    // 两个8字节的mov，随后读取type或者number的指令可以直接从store转发，
+    // 16字节的movups写入后再读其中一半会导致store forwarding失败
+    emitLoad(as, RAX, srcBase, srcDisp);
+    emitLoad(as, RCX, srcBase, srcDisp + 8);
+    emitStore(as, dstBase, dstDisp, RAX);
+    emitStore(as, dstBase, dstDisp + 8, RCX);
+#endif
+}
+
+static void emitStoreValue(Assembler* as, int base, int32_t disp, Value value) {
+    uint64_t words[sizeof(Value) / 8];
+    memcpy(words, &value, sizeof(Value));
+    for (int i = 0; i < (int)(sizeof(Value) / 8); i++) {
+        emitMoveImmediate(as, RAX, words[i]);
+        emitStore(as, base, disp + i * 8, RAX);
+    }
+}
+
+// forward jcc (or jmp when cc < 0) inside the code of one instruction, returns the rel32 to patch
+static int emitForwardJump(Assembler* as, int cc) {
+    if (cc < 0) {
+        emitByte(as, 0xe9);
+    } else {
+        emitByte(as, 0x0f);
+        emitByte(as, 0x80 + cc);
+    }
+    emitInt32(as, 0);
+    return as->count - 4;
+}
+
+static void patchForwardJump(Assembler* as, int at) {
+    patchInt32(as, at, as->count - (at + 4));
+}
+
+// @return condition code that holds when the value isn't a number
+static uint8_t emitTestNumber(Assembler* as, int base, int32_t disp) {
+#ifdef NAN_BOXING
+    emitLoad(as, RAX, base, disp);
+    emitMoveImmediate(as, RCX, QNAN);
+    // and rax, rcx
+    emitBytes(as, 3, 0x48, 0x21, 0xc8);
+    emitCompare(as, RAX, RCX);
+    return CC_E;
+#else
+    emitCompareInt32(as, base, disp + (int32_t)offsetof(Value, type), VAL_NUMBER);
+    return CC_NE;
+#endif
+}
+
+static void emitExitIfNotNumber(Assembler* as, int base, int32_t disp, int offset) {
+    emitExitIf(as, emitTestNumber(as, base, disp), offset);
+}
+
+static void emitExitIfUndefined(Assembler* as, int base, int32_t disp, int offset) {
+#ifdef NAN_BOXING
+    emitLoad(as, RAX, base, disp);
+    emitMoveImmediate(as, RCX, UNDEFINED_VAL);
+    emitCompare(as, RAX, RCX);
+#else
+    emitCompareInt32(as, base, disp + (int32_t)offsetof(Value, type), VAL_UNDEFINED);
+#endif
+    emitExitIf(as, CC_E, offset);
+}
+
+// store xmm0 as a number value
+static void emitStoreNumber(Assembler* as, int base, int32_t disp) {
+#ifndef NAN_BOXING
+    // mov dword [base + disp], VAL_NUMBER
+    emitRex(as, false, 0, base);
+    emitByte(as, 0xc7);
+    emitMemory(as, 0, base, disp + (int32_t)offsetof(Value, type));
+    emitInt32(as, VAL_NUMBER);
+#endif
+    emitSse(as, 0xf2, 0x11, 0, base, disp + NUMBER_OFFSET);
+}
+
+// store al (0 or 1) as a bool value
+static void emitStoreBool(Assembler* as, int base, int32_t disp) {
+    // movzx eax, al
+    emitBytes(as, 3, 0x0f, 0xb6, 0xc0);
+#ifdef NAN_BOXING
+    // TRUE_VAL == FALSE_VAL + 1
+    emitMoveImmediate(as, RCX, FALSE_VAL);
+    // add rax, rcx
+    emitBytes(as, 3, 0x48, 0x01, 0xc8);
+    emitStore(as, base, disp, RAX);
+#else
+    emitRex(as, false, 0, base);
+    emitByte(as, 0xc7);
+    emitMemory(as, 0, base, disp + (int32_t)offsetof(Value, type));
+    emitInt32(as, VAL_BOOL);
+    emitStore(as, base, disp + (int32_t)offsetof(Value, as), RAX);
+#endif
+}
+
+// al = isFalsey(value)
+static void emitFalsey(Assembler* as, int base, int32_t disp) {
+#ifdef NAN_BOXING
+    emitLoad(as, RAX, base, disp);
+    emitMoveImmediate(as, RCX, NIL_VAL);
+    emitCompare(as, RAX, RCX);
+    emitSet(as, CC_E, RDX);
+    emitMoveImmediate(as, RCX, FALSE_VAL);
+    emitCompare(as, RAX, RCX);
+    emitSet(as, CC_E, RAX);
+#else
+    emitCompareInt32(as, base, disp + (int32_t)offsetof(Value, type), VAL_NIL);
+    emitSet(as, CC_E, RDX);
+    emitCompareInt32(as, base, disp + (int32_t)offsetof(Value, type), VAL_BOOL);
+    emitSet(as, CC_E, RAX);
+    // cmp byte [base + disp + as], 0
+    emitRex(as, false, 0, base);
+    emitByte(as, 0x80);
+    emitMemory(as, 7, base, disp + (int32_t)offsetof(Value, as));
+    emitByte(as, 0);
+    emitSet(as, CC_E, RCX);
+    // and al, cl
+    emitBytes(as, 2, 0x20, 0xc8);
+#endif
+    // or al, dl
+    emitBytes(as, 2, 0x08, 0xd0);
+}
+
+// a Value in memory at [base + disp]
+typedef struct {
+    int base;
+    int32_t disp;
+} Operand;
+
+static Operand memoryOperand(int base, int32_t disp) {
+    Operand result = { base, disp };
+    return result;
+}
+
+// load both operands of a binary number instruction to xmm0 and xmm1
+static void emitNumberOperands(Assembler* as, Operand b, Operand c, int offset) {
+    emitExitIfNotNumber(as, b.base, b.disp, offset);
+    emitExitIfNotNumber(as, c.base, c.disp, offset);
+    emitSse(as, 0xf2, 0x10, 0, b.base, b.disp + NUMBER_OFFSET);
+    emitSse(as, 0xf2, 0x10, 1, c.base, c.disp + NUMBER_OFFSET);
+}
+
+static void emitArithmetic(Assembler* as, uint8_t sseOpcode, Operand b, Operand c, Operand dst, int offset) {
+    emitNumberOperands(as, b, c, offset);
+    // op xmm0, xmm1
+    emitBytes(as, 4, 0xf2, 0x0f, sseOpcode, 0xc1);
+    emitStoreNumber(as, dst.base, dst.disp);
+}
+
+static void emitComparison(Assembler* as, uint8_t modrm, Operand b, Operand c, Operand dst, int offset) {
+    emitNumberOperands(as, b, c, offset);
+    // ucomisd
+    emitBytes(as, 4, 0x66, 0x0f, 0x2e, modrm);
+    emitSet(as, CC_A, RAX);
+    emitStoreBool(as, dst.base, dst.disp);
+}
+
+static bool jitValuesEqual(Value* b, Value* c) {
+    return valuesEqual(*b, *c);
+}
+
+// lea reg, [base + disp]
+static void emitAddress(Assembler* as, int reg, Operand value) {
+    emitRex(as, true, reg, value.base);
+    emitByte(as, 0x8d);
+    emitMemory(as, reg, value.base, value.disp);
+}
+
+static void emitEqual(Assembler* as, Operand b, Operand c, Operand dst) {
+    int slowB = emitForwardJump(as, emitTestNumber(as, b.base, b.disp));
+    int slowC = emitForwardJump(as, emitTestNumber(as, c.base, c.disp));
+    emitSse(as, 0xf2, 0x10, 0, b.base, b.disp + NUMBER_OFFSET);
+    // ucomisd xmm0, [c], NaN is unordered and never equal
+    emitSse(as, 0x66, 0x2e, 0, c.base, c.disp + NUMBER_OFFSET);
+    emitSet(as, CC_E, RAX);
+    emitSet(as, CC_NP, RCX);
+    // and al, cl
+    emitBytes(as, 2, 0x20, 0xc8);
+    int done = emitForwardJump(as, -1);
+
+    // 其他类型调用valuesEqual
+    patchForwardJump(as, slowB);
+    patchForwardJump(as, slowC);
+    emitAddress(as, RDI, b);
+    emitAddress(as, RSI, c);
+    emitMoveImmediate(as, RAX, (uint64_t)(uintptr_t)jitValuesEqual);
+    // call rax
+    emitBytes(as, 2, 0xff, 0xd0);
+
+    patchForwardJump(as, done);
+    emitStoreBool(as, dst.base, dst.disp);
+}
+
+// operands of register instructions are locals or constants known at compile time
+static Operand registerOperand(uint8_t mode, uint8_t constantFlag, uint8_t index) {
+    return memoryOperand((mode & constantFlag) ? R13 : RBX, index * VALUE_SIZE);
+}
+
+static void emitRegisterInstruction(Assembler* as, uint8_t instruction, int offset) {
+    uint8_t* code = as->chunk->code + offset;
+    uint8_t mode = code[2];
+    Operand b = registerOperand(mode, REG_B_CONSTANT, code[3]);
+    Operand dst = (mode & REG_DST_LOCAL) ? memoryOperand(RBX, code[1] * VALUE_SIZE) : memoryOperand(R12, 0);
+
+    if (instruction == OP_MOVE_R) {
+        emitCopyValue(as, dst.base, dst.disp, b.base, b.disp);
+        return;
+    }
+
+    Operand c = registerOperand(mode, REG_C_CONSTANT, code[4]);
+    switch (instruction) {
+        // 字符串拼接交给解释器
+        case OP_ADD_R:      emitArithmetic(as, 0x58, b, c, dst, offset); break;
+        case OP_SUBTRACT_R: emitArithmetic(as, 0x5c, b, c, dst, offset); break;
+        case OP_MULTIPLY_R: emitArithmetic(as, 0x59, b, c, dst, offset); break;
+        case OP_DIVIDE_R:   emitArithmetic(as, 0x5e, b, c, dst, offset); break;
+        case OP_LESS_R:     emitComparison(as, 0xc8, b, c, dst, offset); break;
+        case OP_GREATER_R:  emitComparison(as, 0xc1, b, c, dst, offset); break;
+        case OP_EQUAL_R:    emitEqual(as, b, c, dst); break;
+        default: return; // Unreachable.
+    }
+
+    if (!(mode & REG_DST_LOCAL)) {
+        emitAddImmediate(as, R12, VALUE_SIZE);
+    }
+}
+
+// rdx = frame->closure->upvalues[index]->location
+static void emitUpvalueLocation(Assembler* as, int index) {
+    emitLoad(as, RDX, R14, (int32_t)offsetof(CallFrame, closure));
+    emitLoad(as, RDX, RDX, (int32_t)offsetof(ObjClosure, upvalues));
+    emitLoad(as, RDX, RDX, index * (int32_t)sizeof(ObjUpvalue*));
+    emitLoad(as, RDX, RDX, (int32_t)offsetof(ObjUpvalue, location));
+}
+
+// call a field access helper in vm.c, exit to the interpreter when it returns false
+static void emitPropertyCall(Assembler* as, bool (*helper)(CallFrame*, Value*, int), int offset) {
+    // 设置字段可能分配shape触发GC，先写回栈顶
+    emitMoveImmediate(as, RCX, (uint64_t)(uintptr_t)&vm.stackTop);
+    emitStore(as, RCX, 0, R12);
+    emitMove(as, RDI, R14);
+    emitMove(as, RSI, R12);
+    // mov edx, offset
+    emitByte(as, 0xba);
+    emitInt32(as, offset);
+    emitMoveImmediate(as, RAX, (uint64_t)(uintptr_t)helper);
+    // call rax; test al, al
+    emitBytes(as, 4, 0xff, 0xd0, 0x84, 0xc0);
+    emitExitIf(as, CC_E, offset);
+}
+
+// rdx = vm.globalValues.values, the array grows when new globals are declared
+static void emitGlobalValues(Assembler* as) {
+    emitMoveImmediate(as, RDX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+    emitLoad(as, RDX, RDX, 0);
+}
+
+// quickened instructions and superinstructions are translated as the generic
+// instruction they start with, the rest of a superinstruction is translated on its own
+static uint8_t baseOpcode(uint8_t instruction) {
+    switch (instruction) {
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+            return OP_ADD;
+        case OP_EQUAL_NUM:
+            return OP_EQUAL;
+        case OP_GET_LOCAL_CONSTANT:
+        case OP_GET_LOCAL_GET_LOCAL:
+        case OP_GET_LOCAL_CONSTANT_LESS_JUMP:
+            return OP_GET_LOCAL;
+        case OP_SET_LOCAL_POP:
+            return OP_SET_LOCAL;
+        case OP_JUMP_IF_FALSE_POP:
+            return OP_JUMP_IF_FALSE;
+        case OP_SET_PROPERTY_POP:
+            return OP_SET_PROPERTY;
+        default:
+            return instruction;
+    }
+}
+
+// long forms share the templates of their short form with a 24 bit operand
+static uint8_t shortOpcode(uint8_t instruction) {
+    switch (instruction) {
+        case OP_CONSTANT_LONG:   return OP_CONSTANT;
+        case OP_GET_LOCAL_LONG:  return OP_GET_LOCAL;
+        case OP_SET_LOCAL_LONG:  return OP_SET_LOCAL;
+        case OP_GET_GLOBAL_LONG: return OP_GET_GLOBAL;
+        case OP_SET_GLOBAL_LONG: return OP_SET_GLOBAL;
+        default:                 return instruction;
+    }
+}
+
+static void emitInstruction(Assembler* as, int offset) {
+    Chunk* chunk = as->chunk;
+    uint8_t* code = chunk->code;
+    // 最后一条指令之后没有操作数
+    uint8_t operand = offset + 1 < chunk->count ? code[offset + 1] : 0;
+    uint16_t shortOperand = offset + 2 < chunk->count
+        ? (uint16_t)((code[offset + 1] << 8) | code[offset + 2]) : 0;
+
+    uint8_t instruction = shortOpcode(baseOpcode(code[offset]));
+    // constant, local slot or global slot of the instruction
+    int32_t index = instruction == OP_GET_GLOBAL || instruction == OP_SET_GLOBAL ? shortOperand : operand;
+    if (instruction != baseOpcode(code[offset])) {
+        index = (code[offset + 1] << 16) | (code[offset + 2] << 8) | code[offset + 3];
+    }
+
+    switch (instruction) {
+        case OP_CONSTANT:
+            emitCopyValue(as, R12, 0, R13, index * VALUE_SIZE);
+            emitAddImmediate(as, R12, VALUE_SIZE);
+            break;
+        case OP_NIL:
+            emitStoreValue(as, R12, 0, NIL_VAL);
+            emitAddImmediate(as, R12, VALUE_SIZE);
+            break;
+        case OP_TRUE:
+            emitStoreValue(as, R12, 0, BOOL_VAL(true));
+            emitAddImmediate(as, R12, VALUE_SIZE);
+            break;
+        case OP_FALSE:
+            emitStoreValue(as, R12, 0, BOOL_VAL(false));
+            emitAddImmediate(as, R12, VALUE_SIZE);
+            break;
+        case OP_POP:
+            emitAddImmediate(as, R12, -VALUE_SIZE);
+            break;
+        case OP_GET_LOCAL:
+            emitCopyValue(as, R12, 0, RBX, index * VALUE_SIZE);
+            emitAddImmediate(as, R12, VALUE_SIZE);
+            break;
+        case OP_SET_LOCAL:
+            emitCopyValue(as, RBX, index * VALUE_SIZE, R12, -VALUE_SIZE);
+            break;
+        case OP_GET_GLOBAL:
+            emitGlobalValues(as);
+            emitExitIfUndefined(as, RDX, index * VALUE_SIZE, offset);
+            emitCopyValue(as, R12, 0, RDX, index * VALUE_SIZE);
+            emitAddImmediate(as, R12, VALUE_SIZE);
+            break;
+        case OP_SET_GLOBAL:
+            emitGlobalValues(as);
+            emitExitIfUndefined(as, RDX, index * VALUE_SIZE, offset);
+            emitCopyValue(as, RDX, index * VALUE_SIZE, R12, -VALUE_SIZE);
+            break;
+        case OP_GET_UPVALUE:
+            emitUpvalueLocation(as, operand);
+            emitCopyValue(as, R12, 0, RDX, 0);
+            emitAddImmediate(as, R12, VALUE_SIZE);
+            break;
+        case OP_SET_UPVALUE:
+#ifdef GENERATIONAL_GC
+            // 关闭的upvalue在堆上，写入需要经过解释器中的写屏障
+            emitExit(as, offset);
+#else
+            // 标记期间写入需要经过解释器中的写屏障
+            emitMoveImmediate(as, RAX, (uint64_t)(uintptr_t)&vm.gcPhase);
+            // cmp dword [rax], GC_MARK
+            emitBytes(as, 3, 0x83, 0x38, GC_MARK);
+            emitExitIf(as, CC_E, offset);
+            emitUpvalueLocation(as, operand);
+            emitCopyValue(as, RDX, 0, R12, -VALUE_SIZE);
+#endif
+            break;
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_LESS:
+        case OP_GREATER:
+        case OP_EQUAL: {
+            Operand b = memoryOperand(R12, -2 * VALUE_SIZE);
+            Operand c = memoryOperand(R12, -VALUE_SIZE);
+            switch (instruction) {
+                case OP_ADD:      emitArithmetic(as, 0x58, b, c, b, offset); break;
+                case OP_SUBTRACT: emitArithmetic(as, 0x5c, b, c, b, offset); break;
+                case OP_MULTIPLY: emitArithmetic(as, 0x59, b, c, b, offset); break;
+                case OP_DIVIDE:   emitArithmetic(as, 0x5e, b, c, b, offset); break;
+                // ucomisd xmm1, xmm0, a < b is b > a
+                case OP_LESS:     emitComparison(as, 0xc8, b, c, b, offset); break;
+                // ucomisd xmm0, xmm1
+                case OP_GREATER:  emitComparison(as, 0xc1, b, c, b, offset); break;
+                default:          emitEqual(as, b, c, b); break;
+            }
+            emitAddImmediate(as, R12, -VALUE_SIZE);
+            break;
+        }
+        case OP_ADD_R:
+        case OP_SUBTRACT_R:
+        case OP_MULTIPLY_R:
+        case OP_DIVIDE_R:
+        case OP_LESS_R:
+        case OP_GREATER_R:
+        case OP_EQUAL_R:
+        case OP_MOVE_R:
+            emitRegisterInstruction(as, instruction, offset);
+            break;
+        case OP_NEGATE:
+            emitExitIfNotNumber(as, R12, -VALUE_SIZE, offset);
+            // btc qword [r12 - size], 63 flips the sign bit
+            emitRex(as, true, 0, R12);
+            emitBytes(as, 2, 0x0f, 0xba);
+            emitMemory(as, 7, R12, -VALUE_SIZE + NUMBER_OFFSET);
+            emitByte(as, 63);
+            break;
+        case OP_NOT:
+            emitFalsey(as, R12, -VALUE_SIZE);
+            emitStoreBool(as, R12, -VALUE_SIZE);
+            break;
+        case OP_GET_PROPERTY:
+            emitPropertyCall(as, jitGetProperty, offset);
+            break;
+        case OP_SET_PROPERTY:
+            emitPropertyCall(as, jitSetProperty, offset);
+            emitAddImmediate(as, R12, -VALUE_SIZE);
+            break;
+        case OP_JUMP:
+            emitJump(as, -1, offset + 3 + shortOperand);
+            break;
+        case OP_JUMP_IF_FALSE:
+            emitFalsey(as, R12, -VALUE_SIZE);
+            // test al, al
+            emitBytes(as, 2, 0x84, 0xc0);
+            emitJump(as, CC_NE, offset + 3 + shortOperand);
+            break;
+        case OP_LOOP:
+#ifdef GENERATIONAL_GC
+            // 新生代用完后回到解释器，在OP_LOOP的安全点回收新生代
+            emitMoveImmediate(as, RAX, (uint64_t)(uintptr_t)&vm.nurseryFull);
+            // cmp byte [rax], 0
+            emitBytes(as, 3, 0x80, 0x38, 0x00);
+            emitExitIf(as, CC_NE, offset);
+#endif
+            emitJump(as, -1, offset + 3 - shortOperand);
+            break;
+        default:
+            // 调用、返回以及可能分配对象的指令由解释器执行，
+            // 名字常量超过一个字节的属性指令也在这里回到解释器
+            emitExit(as, offset);
+            break;
+    }
+}
+
+static void freeAssembler(Assembler* as) {
+    free(as->code);
+    free(as->jumps);
+    free(as->exits);
+}
+
+void jitCompile(ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    Assembler as = { 0 };
+    as.chunk = chunk;
+
+    uint32_t* offsets = malloc(sizeof(uint32_t) * chunk->count);
+    if (offsets == NULL) return;
+
+    // prologue, save callee saved registers and jump to the entry instruction
+    emitBytes(&as, 9, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);
+    emitMove(&as, R14, RDI);
+    emitMove(&as, R12, RSI);
+    emitMove(&as, R13, RDX);
+    emitLoad(&as, RBX, R14, (int32_t)offsetof(CallFrame, slots));
+    // jmp rcx
+    emitBytes(&as, 2, 0xff, 0xe1);
+
+    // epilogue, rax holds ip to resume the interpreter at
+    as.epilogue = as.count;
+    emitStore(&as, R14, (int32_t)offsetof(CallFrame, ip), RAX);
+    emitMoveImmediate(&as, RCX, (uint64_t)(uintptr_t)&vm.stackTop);
+    emitStore(&as, RCX, 0, R12);
+    emitBytes(&as, 9, 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b);
+    emitByte(&as, 0xc3);
+
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        offsets[offset] = (uint32_t)as.count;
+        emitInstruction(&as, offset);
+    }
+
+    for (int i = 0; i < as.jumpCount; i++) {
+        Fixup* jump = &as.jumps[i];
+        patchInt32(&as, jump->at, (int32_t)offsets[jump->target] - (jump->at + 4));
+    }
+    for (int i = 0; i < as.exitCount; i++) {
+        Fixup* stub = &as.exits[i];
+        patchInt32(&as, stub->at, as.count - (stub->at + 4));
+        emitExit(&as, stub->target);
+    }
+
+    // 写入代码后再改为可执行，页面不同时可写可执行
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t size = ((size_t)as.count + pageSize - 1) / pageSize * pageSize;
+    uint8_t* code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        free(offsets);
+        freeAssembler(&as);
+        return;
+    }
+    memcpy(code, as.code, as.count);
+    if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, size);
+        free(offsets);
+        freeAssembler(&as);
+        return;
+    }
+
+    JitCode* jit = malloc(sizeof(JitCode));
+    if (jit == NULL) exit(1);
+    jit->code = code;
+    jit->size = size;
+    jit->offsets = offsets;
+    function->jit = jit;
+
+#ifdef DEBUG_LOG_JIT
+    printf("-- jit %s %d bytes of bytecode to %d bytes of machine code\n",
+           function->name != NULL ? function->name->chars : "<script>", chunk->count, as.count);
+#endif
+
+    freeAssembler(&as);
+}
+
+void jitExecute(CallFrame* frame) {
+    ObjFunction* function = frame->closure->function;
+    JitCode* jit = function->jit;
+    int offset = (int)(frame->ip - function->chunk.code);
+
+    JitEntry entry = (JitEntry)(void*)jit->code;
+    entry(frame, vm.stackTop, function->chunk.constants.values, jit->code + jit->offsets[offset]);
+}
+
+void jitFree(ObjFunction* function) {
+    if (function->jit == NULL) return;
+
+    munmap(function->jit->code, function->jit->size);
+    free(function->jit->offsets);
+    free(function->jit);
+    function->jit = NULL;
+}
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef CLOX_JIT
+
+// 函数调用次数加上循环回跳次数达到阈值后编译为机器码
+#define JIT_THRESHOLD 1000
+
+#define JIT_COUNT(function) \
+    do { \
+        if ((function)->hotness < JIT_THRESHOLD && ++(function)->hotness == JIT_THRESHOLD) { \
+            jitCompile(function); \
+        } \
+    } while (false)
+
+typedef struct JitCode {
+    // mmap分配的可执行页
+    uint8_t* code;
+    size_t size;
+    // 每条字节码指令对应的机器码偏移，解释器从任意指令边界进入机器码
+    uint32_t* offsets;
+} JitCode;
+
+void jitCompile(ObjFunction* function);
+
+/**
+ * run machine code of frame's function starting at frame->ip, returns when it
+ * reaches an instruction left to the interpreter, with frame->ip pointing to
+ * that instruction and vm.stackTop written back
+ */
+void jitExecute(CallFrame* frame);
+
+void jitFree(ObjFunction* function);
+
+#endif
+
+#endif
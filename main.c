@@ -201,7 +201,12 @@ int main(int argc, const char* argv[]) {
 // "var a = Cruller();"
 // "a.finish(\"test\");";
 
-	interpret(source);
+	// run a script file when given one, e.g. the scripts under benchmark/
+	if (argc == 2) {
+		runFile(argv[1]);
+	} else {
+		interpret(source);
+	}
 
 	// if (argc == 1) {
 	// 	repl();
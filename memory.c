@@ -1,5 +1,8 @@
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "table.h"
 #include "vm.h"
@@ -9,19 +12,71 @@
 #include "debug.h"
 #endif // DEBUG_LOG_GC
 
+#ifdef DEBUG_PROFILE_GC
+#include <stdio.h>
+#include <time.h>
+#endif
+
+#if defined(PARALLEL_MARK) || defined(CONCURRENT_MARK) || defined(BACKGROUND_SWEEP)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #define GC_HEAP_GROW_FACTOR 2
 
+static void collectSlice();
+#ifdef PARALLEL_MARK
+static void finishMark();
+static void stopMarkWorkers();
+#endif
+#ifdef CONCURRENT_MARK
+static void stopMarker();
+#endif
+
+static void finishSweep();
+#ifdef COMPACT_GC
+static void checkFragmentation();
+#endif
+#ifdef BACKGROUND_SWEEP
+static bool startSweeper();
+static void pollSweeper(bool wait);
+static void stopSweeper();
+
+// 清除线程只释放内存，释放的字节数由解释器线程并入vm.bytesAllocated
+static size_t sweptBytes;
+static __thread bool inSweeper;
+static bool sweeperStarted;
+#endif
+
+// count size bytes freed, the sweeper thread leaves them to the interpreter
+static void countFreed(size_t size) {
+#ifdef BACKGROUND_SWEEP
+    if (inSweeper) {
+        __atomic_add_fetch(&sweptBytes, size, __ATOMIC_RELAXED);
+        return;
+    }
+#endif
+    vm.bytesAllocated -= size;
+}
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+#ifdef BACKGROUND_SWEEP
+    if (inSweeper) {
+        countFreed(oldSize);
+        free(pointer);
+        return NULL;
+    }
+#endif
     vm.bytesAllocated += newSize - oldSize;
     if (newSize > oldSize) {
 #ifdef DEBUG_STRESS_GC
-        collectGarbage();
-#endif // DEBUG_STRESS_GC
-
-        if (vm.bytesAllocated > vm.nextGC) {
-            collectGarbage();
+        collectSlice();
+#else
+        // 回收开始后每次分配都推进一段，分配越多回收越快完成
+        if (vm.gcPhase != GC_IDLE || vm.bytesAllocated > vm.nextGC) {
+            collectSlice();
         }
+#endif // DEBUG_STRESS_GC
     }
 
 	if (newSize == 0) {
@@ -35,77 +90,915 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
 	return result;
 }
 
-static void freeObject(Obj* object) {
-#ifdef DEBUG_LOG_GC
-    printf("%p free type %d\n", (void*)object, object->type);
-#endif // DEBUG
+#if defined(GENERATIONAL_GC) || defined(COMPACT_GC)
+static size_t objectSize(Obj* object) {
+    switch (object->type) {
+        case OBJ_STRING:       return sizeof(ObjString);
+        case OBJ_FUNCTION:     return sizeof(ObjFunction);
+        case OBJ_NATIVE:       return sizeof(ObjNative);
+        case OBJ_CLOSURE:      return sizeof(ObjClosure);
+        case OBJ_UPVALUE:      return sizeof(ObjUpvalue);
+        case OBJ_CLASS:        return sizeof(ObjClass);
+        case OBJ_INSTANCE:     return sizeof(ObjInstance);
+        case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+        case OBJ_SHAPE:        return sizeof(ObjShape);
+    }
+    return 0;
+}
+#endif
 
+/**
+ * free the arrays and tables owned by object, but not the object itself.
+ * chunks and tables are freed through a copy, so reinitializing them
+ * doesn't write to the heap page of the dead object
+ */
+static void releaseObject(Obj* object) {
     switch (object->type) {
         case OBJ_STRING:
         {
             ObjString *string = (ObjString*)object;
             FREE_ARRAY(char , string->chars, string->length + 1);
-            FREE(ObjString, object);
             break;
         }
         case OBJ_FUNCTION:
         {
             ObjFunction *function = (ObjFunction*) object;
-            freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
-            break;
-        }
-        case OBJ_NATIVE: {
-            FREE(OBJ_NATIVE, object);
+#ifdef CLOX_JIT
+            jitFree(function);
+#endif
+            Chunk chunk = function->chunk;
+            freeChunk(&chunk);
             break;
         }
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*)object;
             FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-            FREE(OBJ_CLOSURE, object);
+            if (closure->values != NULL) {
+                FREE_ARRAY(ObjUpvalue, closure->values, closure->upvalueCount);
+            }
             break;
         }
-        case OBJ_UPVALUE: {
-            FREE(ObjUpvalue, object);
+        case OBJ_CLASS: {
+            Table methods = ((ObjClass*)object)->methods;
+            freeTable(&methods);
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            FREE_ARRAY(Value, instance->slots, instance->slotCapacity);
+            Table fields = instance->fields;
+            freeTable(&fields);
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            Table slots = shape->slots;
+            Table transitions = shape->transitions;
+            freeTable(&slots);
+            freeTable(&transitions);
+            break;
+        }
+        case OBJ_NATIVE:
+        case OBJ_UPVALUE:
+        case OBJ_BOUND_METHOD:
+            break;
+    }
+}
+
+// 堆页开头放描述符的指针
+#define PAGE_CELLS_OFFSET HEAP_CELL_ALIGN
+
+static int sizeClassOf(size_t size) {
+    int sizeClass = (int)((size + HEAP_CELL_ALIGN - 1) / HEAP_CELL_ALIGN) - 1;
+    // 所有对象类型都小于最大的分类
+    if (sizeClass >= HEAP_SIZE_CLASSES) exit(1);
+    return sizeClass;
+}
+
+static Page* newPage(int sizeClass) {
+    void* memory;
+#ifdef _WIN32
+    memory = _aligned_malloc(HEAP_PAGE_SIZE, HEAP_PAGE_SIZE);
+#else
+    if (posix_memalign(&memory, HEAP_PAGE_SIZE, HEAP_PAGE_SIZE) != 0) memory = NULL;
+#endif
+    Page* page = (Page*)malloc(sizeof(Page));
+    if (memory == NULL || page == NULL) exit(1);
+
+    *(Page**)memory = page;
+    page->base = (uint8_t*)memory;
+    page->cells = (uint8_t*)memory + PAGE_CELLS_OFFSET;
+    // 按地址顺序分配
+    page->nextCell = 0;
+    page->sizeClass = sizeClass;
+    page->cellSize = (sizeClass + 1) * HEAP_CELL_ALIGN;
+    page->cellCount = (int)((HEAP_PAGE_SIZE - PAGE_CELLS_OFFSET) / page->cellSize);
+    page->liveCount = 0;
+    memset(page->used, 0, sizeof(page->used));
+    memset(page->marks, 0, sizeof(page->marks));
+#ifdef COMPACT_GC
+    page->evacuated = false;
+#endif
+
+    SizeClass* klass = &vm.sizeClasses[sizeClass];
+    page->next = klass->pages;
+    klass->pages = page;
+    page->nextFree = klass->freePages;
+    klass->freePages = page;
+    return page;
+}
+
+static void freePage(Page* page) {
+#ifdef _WIN32
+    _aligned_free(page->base);
+#else
+    free(page->base);
+#endif
+    free(page);
+}
+
+#define IS_USED(page, granule) (((page)->used[(granule) / 64] >> ((granule) % 64)) & 1)
+
+#define CELL_AT(page, granule) ((Obj*)((page)->base + (size_t)(granule) * HEAP_CELL_ALIGN))
+
+// free the object starting at granule of page, its cell is free once the used bit is clear
+static void freeCell(Page* page, int granule) {
+    Obj* object = CELL_AT(page, granule);
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void*)object, object->type);
+#endif // DEBUG
+
+    releaseObject(object);
+    countFreed(page->cellSize);
+
+    page->used[granule / 64] &= ~((uint64_t)1 << (granule % 64));
+    page->liveCount--;
+}
+
+// free the objects of page without a mark bit, then clear the marks
+static void sweepPage(Page* page) {
+    uint64_t marked = 0;
+    for (int word = 0; word < PAGE_BITMAP_WORDS; word++) {
+        marked |= page->marks[word];
+        uint64_t dead = page->used[word] & ~page->marks[word];
+        for (int bit = 0; dead != 0; bit++, dead >>= 1) {
+            if (dead & 1) {
+                freeCell(page, word * 64 + bit);
+            }
+        }
+    }
+    // 没有存活对象的页位图已经是0
+    if (marked != 0) {
+        memset(page->marks, 0, sizeof(page->marks));
+    }
+}
+
+/**
+ * put a swept page back to its size class. an empty page goes back to the
+ * system, unless the class has no other page to allocate in
+ */
+static void keepPage(Page* page) {
+    SizeClass* klass = &vm.sizeClasses[page->sizeClass];
+    if (page->liveCount == 0 && klass->freePages != NULL) {
+        freePage(page);
+        return;
+    }
+
+    page->next = klass->pages;
+    klass->pages = page;
+    if (page->liveCount < page->cellCount) {
+        page->nextCell = 0;
+        page->nextFree = klass->freePages;
+        klass->freePages = page;
+    }
+}
+
+// free every object of the pages and the pages themselves
+static void freePages(Page* page) {
+    while (page != NULL) {
+        Page* next = page->next;
+        for (int granule = 0; granule < PAGE_GRANULES; granule++) {
+            if (IS_USED(page, granule)) {
+                freeCell(page, granule);
+            }
+        }
+        freePage(page);
+        page = next;
+    }
+}
+
+static bool hasSweepPages() {
+    for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+        if (vm.sizeClasses[i].sweepPages != NULL) return true;
+    }
+    return false;
+}
+
+/**
+ * take a free cell of the size class without starting a collection. during
+ * sweeping the unswept pages of the class are swept first, lazily, new
+ * pages are only added when they don't free anything
+ */
+static Obj* takeCell(int sizeClass) {
+    SizeClass* klass = &vm.sizeClasses[sizeClass];
+    while (klass->freePages == NULL) {
+#ifdef BACKGROUND_SWEEP
+        // 取回清除线程已经清除的页
+        if (vm.gcPhase == GC_SWEEP && sweeperStarted) {
+            pollSweeper(false);
+            if (klass->freePages != NULL) break;
+        }
+#endif
+        if (klass->sweepPages == NULL) {
+            newPage(sizeClass);
+            break;
+        }
+
+        Page* page = klass->sweepPages;
+        klass->sweepPages = page->next;
+        sweepPage(page);
+        keepPage(page);
+        if (klass->sweepPages == NULL && !hasSweepPages()) {
+            finishSweep();
+        }
+    }
+
+    // 空闲单元按used位图查找，不在空闲单元中写入链表，清除时也就不用写入堆页
+    Page* page = klass->freePages;
+    uint8_t* cell;
+    int granule;
+    do {
+        cell = page->cells + (size_t)page->nextCell++ * page->cellSize;
+        granule = (int)((cell - page->base) / HEAP_CELL_ALIGN);
+    } while (IS_USED(page, granule));
+
+    page->used[granule / 64] |= (uint64_t)1 << (granule % 64);
+    page->liveCount++;
+    if (page->liveCount == page->cellCount) {
+        klass->freePages = page->nextFree;
+    }
+    return (Obj*)cell;
+}
+
+void* allocateCell(size_t size) {
+    int sizeClass = sizeClassOf(size);
+    vm.bytesAllocated += (size_t)(sizeClass + 1) * HEAP_CELL_ALIGN;
+#ifdef DEBUG_STRESS_GC
+    collectSlice();
+#else
+    if (vm.gcPhase != GC_IDLE || vm.bytesAllocated > vm.nextGC) {
+        collectSlice();
+    }
+#endif // DEBUG_STRESS_GC
+    return takeCell(sizeClass);
+}
+
+void writeBarrierTable(Obj* owner, Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        if (entry->key != NULL) {
+            writeBarrier(owner, OBJ_VAL(entry->key));
+            writeBarrier(owner, entry->value);
+        }
+    }
+}
+
+#ifdef GENERATIONAL_GC
+// 新生代中的对象按8字节对齐连续存放，可以根据类型得到的大小依次遍历
+#define NURSERY_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+// 新生代回收时待扫描的晋升对象
+static Obj** promoted;
+static int promotedCount;
+static int promotedCapacity;
+
+/**
+ * @return NULL when the nursery is used up, the caller allocates in the old
+ * generation instead and the nursery is collected at the next safepoint
+ */
+Obj* allocateNursery(size_t size) {
+    size = NURSERY_ALIGN(size);
+    if (vm.nurseryTop + size > vm.nursery + NURSERY_SIZE) {
+        vm.nurseryFull = true;
+        return NULL;
+    }
+
+    Obj* object = (Obj*)vm.nurseryTop;
+    vm.nurseryTop += size;
+    return object;
+}
+
+void rememberObject(Obj* object) {
+    if (vm.rememberedCount + 1 > vm.rememberedCapacity) {
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.remembered = (Obj**)realloc(vm.remembered, sizeof(Obj*) * vm.rememberedCapacity);
+        if (vm.remembered == NULL) exit(1);
+    }
+
+    object->isRemembered = true;
+    vm.remembered[vm.rememberedCount++] = object;
+}
+
+// release every young object that wasn't promoted
+static void releaseNursery() {
+    for (uint8_t* p = vm.nursery; p < vm.nurseryTop; p += NURSERY_ALIGN(objectSize((Obj*)p))) {
+        Obj* object = (Obj*)p;
+        if (object->forward == NULL) {
+#ifdef DEBUG_LOG_GC
+            printf("%p release young type %d\n", (void*)object, object->type);
+#endif
+            releaseObject(object);
+        }
+    }
+}
+
+// copy a young object to the old generation, the young object keeps the address of its copy in forward
+static Obj* promote(Obj* object) {
+    size_t size = objectSize(object);
+    // 晋升时不能触发完整回收，回收结束后再检查nextGC
+    int sizeClass = sizeClassOf(size);
+    Obj* copy = takeCell(sizeClass);
+    vm.bytesAllocated += (size_t)(sizeClass + 1) * HEAP_CELL_ALIGN;
+
+    memcpy(copy, object, size);
+    object->forward = copy;
+    // 标记期间晋升的对象保持原来的颜色
+    if (isMarked(object)) {
+        setMarked(copy);
+    }
+
+    // closed upvalue points to its own closed field
+    if (object->type == OBJ_UPVALUE) {
+        ObjUpvalue* upvalue = (ObjUpvalue*)object;
+        if (upvalue->location == &upvalue->closed) {
+            ((ObjUpvalue*)copy)->location = &((ObjUpvalue*)copy)->closed;
+        }
+    }
+
+#ifdef DEBUG_LOG_GC
+    printf("%p promote to %p ", (void*)object, (void*)copy);
+    printValue(OBJ_VAL(copy));
+    printf("\n");
+#endif
+
+    if (promotedCount + 1 > promotedCapacity) {
+        promotedCapacity = GROW_CAPACITY(promotedCapacity);
+        promoted = (Obj**)realloc(promoted, sizeof(Obj*) * promotedCapacity);
+        if (promoted == NULL) exit(1);
+    }
+    promoted[promotedCount++] = copy;
+    return copy;
+}
+
+#endif
+
+#if defined(GENERATIONAL_GC) || defined(COMPACT_GC)
+#ifdef COMPACT_GC
+// 整理堆时更新引用，否则是新生代回收
+static bool compacting;
+#endif
+
+// @return the address of object after the nursery collection or compaction
+static Obj* forwardObject(Obj* object) {
+    if (object == NULL) {
+        return object;
+    }
+#ifdef COMPACT_GC
+    if (compacting) {
+#ifdef GENERATIONAL_GC
+        if (IS_YOUNG(object)) return object;
+#endif
+        return PAGE_OF(object)->evacuated ? *(Obj**)object : object;
+    }
+#endif
+#ifdef GENERATIONAL_GC
+    if (IS_YOUNG(object)) {
+        return object->forward != NULL ? object->forward : promote(object);
+    }
+#endif
+    return object;
+}
+
+#define FORWARD(pointer) ((pointer) = (void*)forwardObject((Obj*)(pointer)))
+
+static void forwardValue(Value* value) {
+    if (IS_OBJ(*value)) {
+        Obj* object = AS_OBJ(*value);
+        Obj* forwarded = forwardObject(object);
+        if (forwarded != object) {
+            *value = OBJ_VAL(forwarded);
+        }
+    }
+}
+
+static void forwardArray(ValueArray* array) {
+    for (int i = 0; i < array->count; i++) {
+        forwardValue(&array->values[i]);
+    }
+}
+
+// 表中的位置由字符串的hash决定，更新键的地址不需要重新插入
+static void forwardTable(Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        FORWARD(entry->key);
+        forwardValue(&entry->value);
+    }
+}
+
+// update every reference from an old object to a moved object, same fields as blackenObject
+static void forwardReferences(Obj* object) {
+    switch (object->type) {
+        case OBJ_STRING:
+            break;
+        case OBJ_NATIVE:
+            FORWARD(((ObjNative*)object)->name);
+            break;
+        case OBJ_UPVALUE:
+            forwardValue(&((ObjUpvalue*)object)->closed);
+            break;
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            FORWARD(function->name);
+            forwardArray(&function->chunk.constants);
+            int cacheCount = LOAD_PUBLISHED(function->chunk.cacheCount);
+        for (int i = 0; i < cacheCount; i++) {
+                InlineCache* cache = &function->chunk.caches[i];
+                for (int j = 0; j < INLINE_CACHE_SIZE; j++) {
+                    FORWARD(cache->entries[j].klass);
+                    FORWARD(cache->entries[j].shape);
+                    FORWARD(cache->entries[j].transition);
+                    FORWARD(cache->entries[j].method);
+                }
+            }
+            int callCacheCount = LOAD_PUBLISHED(function->chunk.callCacheCount);
+        for (int i = 0; i < callCacheCount; i++) {
+                FORWARD(function->chunk.callCaches[i].callee);
+                FORWARD(function->chunk.callCaches[i].closure);
+            }
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            FORWARD(closure->function);
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                if (IS_VALUE_UPVALUE(closure, closure->upvalues[i])) {
+                    forwardValue(&closure->upvalues[i]->closed);
+                } else {
+                    FORWARD(closure->upvalues[i]);
+                }
+            }
             break;
         }
         case OBJ_CLASS: {
             ObjClass* klass = (ObjClass*)object;
-            freeTable(&klass->methods);
-            FREE(OBJ_CLASS, object);
+            FORWARD(klass->name);
+            forwardTable(&klass->methods);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
-            freeTable(&instance->fields);
-            FREE(OBJ_INSTANCE, instance);
+            FORWARD(instance->klass);
+            if (instance->shape != NULL) {
+                FORWARD(instance->shape);
+                for (int i = 0; i < instance->shape->fieldCount; i++) {
+                    forwardValue(&instance->slots[i]);
+                }
+            }
+            forwardTable(&instance->fields);
             break;
         }
-        case OBJ_BOUND_METHOD:
-            FREE(ObjBoundMethod, object);
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            FORWARD(shape->parent);
+            FORWARD(shape->name);
+            forwardTable(&shape->slots);
+            forwardTable(&shape->transitions);
+            break;
+        }
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            forwardValue(&bound->receiver);
+            FORWARD(bound->method);
             break;
+        }
+    }
+}
+
+// same roots as markRoots, compiler roots are left out since objects are
+// only moved at safepoints of run() while nothing is being compiled
+static void forwardRoots() {
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        forwardValue(slot);
+    }
+
+    for (int i = 0; i < vm.frameCount; i++) {
+        FORWARD(vm.frames[i].closure);
+    }
+
+    for (int i = 0; i < vm.openTop; i++) {
+        FORWARD(vm.openUpvalues[i]);
+    }
+
+    forwardTable(&vm.globals);
+    forwardArray(&vm.globalValues);
+    forwardArray(&vm.globalNames);
+
+    FORWARD(vm.initString);
+    FORWARD(vm.rootShape);
+
+    // 增量标记中的灰色对象
+    for (int i = 0; i < vm.grayCount; i++) {
+        FORWARD(vm.grayStack[i]);
+    }
+}
+
+#endif
+
+#ifdef GENERATIONAL_GC
+// interned strings are weak references, drop the young ones that weren't promoted
+static void forwardStrings() {
+    for (int i = 0; i < vm.strings.capacity; i++) {
+        Entry* entry = &vm.strings.entries[i];
+        if (entry->key == NULL || !IS_YOUNG(entry->key)) continue;
+
+        if (entry->key->obj.forward != NULL) {
+            entry->key = (ObjString*)entry->key->obj.forward;
+        } else {
+            // tombstone
+            entry->key = NULL;
+            entry->value = BOOL_VAL(true);
+        }
     }
 }
+#endif
 
 void freeObjects() {
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        Obj* next = object->next;
-        freeObject(object);
-        object = next;
+#ifdef CONCURRENT_MARK
+    stopMarker();
+#endif
+#ifdef BACKGROUND_SWEEP
+    stopSweeper();
+#endif
+    for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+        SizeClass* klass = &vm.sizeClasses[i];
+        freePages(klass->pages);
+        freePages(klass->sweepPages);
+        klass->pages = NULL;
+        klass->freePages = NULL;
+        klass->sweepPages = NULL;
     }
 
     // set to pointer to NULL after reclamation
     free(vm.grayStack);
     vm.grayStack = NULL;
+
+#ifdef PARALLEL_MARK
+    stopMarkWorkers();
+#endif
+
+#ifdef GENERATIONAL_GC
+    releaseNursery();
+    vm.nurseryTop = vm.nursery;
+
+    free(vm.remembered);
+    vm.remembered = NULL;
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
+
+    free(promoted);
+    promoted = NULL;
+    promotedCapacity = 0;
+#endif
+}
+
+#ifdef PARALLEL_MARK
+static void blackenObject(Obj* object);
+
+/*
+ * 并行标记时每个线程有自己的灰色对象双端队列（Chase-Lev），线程在自己队列的底部压入和弹出，
+ * 队列为空时从其他线程队列的顶部窃取。标记位用原子交换设置，每个对象只会被一个线程压入
+ */
+typedef struct {
+    // power of two
+    int64_t size;
+    Obj** items;
+} GrayArray;
+
+typedef struct {
+    int64_t top;
+    int64_t bottom;
+    GrayArray* array;
+    // 扩容前的数组可能还在被窃取的线程读取，标记结束后才释放
+    GrayArray** retired;
+    int retiredCount;
+    int retiredCapacity;
+    // 选择窃取对象的随机数
+    uint32_t seed;
+    // 线程启动时的markRound
+    uint64_t round;
+    pthread_t thread;
+} MarkWorker;
+
+#define GRAY_ARRAY_INITIAL 1024
+
+// 第0个由执行回收的主线程使用
+static MarkWorker markWorkers[GC_MARK_THREADS_MAX];
+static int startedWorkers = 1;
+
+static pthread_mutex_t markMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t markStart = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t markDone = PTHREAD_COND_INITIALIZER;
+// 以下由markMutex保护
+static uint64_t markRound;
+static int markThreads;
+static int finishedWorkers;
+static bool stopWorkers;
+
+// 队列为空、正在等待其他线程的线程数
+static int idleWorkers;
+// 当前线程正在标记时使用的队列，串行标记时为NULL
+static __thread MarkWorker* currentWorker;
+
+static GrayArray* newGrayArray(int64_t size) {
+    GrayArray* array = (GrayArray*) malloc(sizeof(GrayArray));
+    if (array == NULL) exit(1);
+    array->size = size;
+    array->items = (Obj**) malloc(sizeof(Obj*) * size);
+    if (array->items == NULL) exit(1);
+    return array;
+}
+
+static void freeGrayArray(GrayArray* array) {
+    free(array->items);
+    free(array);
+}
+
+static void growGrayArray(MarkWorker* worker, int64_t top, int64_t bottom) {
+    GrayArray* old = worker->array;
+    GrayArray* array = newGrayArray(old->size * 2);
+    for (int64_t i = top; i < bottom; i++) {
+        array->items[i & (array->size - 1)] =
+            __atomic_load_n(&old->items[i & (old->size - 1)], __ATOMIC_RELAXED);
+    }
+
+    if (worker->retiredCount + 1 > worker->retiredCapacity) {
+        worker->retiredCapacity = GROW_CAPACITY(worker->retiredCapacity);
+        worker->retired = (GrayArray**) realloc(worker->retired, sizeof(GrayArray*) * worker->retiredCapacity);
+        if (worker->retired == NULL) exit(1);
+    }
+    worker->retired[worker->retiredCount++] = old;
+    __atomic_store_n(&worker->array, array, __ATOMIC_RELEASE);
+}
+
+// only called by the owner of the deque
+static void pushGray(MarkWorker* worker, Obj* object) {
+    int64_t bottom = __atomic_load_n(&worker->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&worker->top, __ATOMIC_ACQUIRE);
+    if (bottom - top > worker->array->size - 1) {
+        growGrayArray(worker, top, bottom);
+    }
+    GrayArray* array = worker->array;
+    __atomic_store_n(&array->items[bottom & (array->size - 1)], object, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+// only called by the owner of the deque, NULL when it's empty
+static Obj* takeGray(MarkWorker* worker) {
+    int64_t bottom = __atomic_load_n(&worker->bottom, __ATOMIC_RELAXED) - 1;
+    GrayArray* array = worker->array;
+    __atomic_store_n(&worker->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&worker->top, __ATOMIC_RELAXED);
+
+    if (top > bottom) {
+        __atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    Obj* object = __atomic_load_n(&array->items[bottom & (array->size - 1)], __ATOMIC_RELAXED);
+    if (top == bottom) {
+        // 最后一个对象，和窃取的线程竞争
+        if (!__atomic_compare_exchange_n(&worker->top, &top, top + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            object = NULL;
+        }
+        __atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return object;
 }
 
+// called by other workers, NULL when the deque is empty or another thread won the race
+static Obj* stealGray(MarkWorker* worker) {
+    int64_t top = __atomic_load_n(&worker->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t bottom = __atomic_load_n(&worker->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom) {
+        return NULL;
+    }
+
+    GrayArray* array = __atomic_load_n(&worker->array, __ATOMIC_ACQUIRE);
+    Obj* object = __atomic_load_n(&array->items[top & (array->size - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&worker->top, &top, top + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return object;
+}
+
+static Obj* stealFromOthers(MarkWorker* worker, int count) {
+    worker->seed = worker->seed * 1103515245u + 12345u;
+    int start = (int)((worker->seed >> 16) % (uint32_t)count);
+    for (int i = 0; i < count; i++) {
+        MarkWorker* victim = &markWorkers[(start + i) % count];
+        if (victim == worker) continue;
+
+        Obj* object = stealGray(victim);
+        if (object != NULL) return object;
+    }
+    return NULL;
+}
+
+static bool hasGray(int count) {
+    for (int i = 0; i < count; i++) {
+        if (__atomic_load_n(&markWorkers[i].top, __ATOMIC_ACQUIRE) <
+            __atomic_load_n(&markWorkers[i].bottom, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void markParallel(MarkWorker* worker, Obj* object) {
+    if (isMarked(object) || setMarked(object)) {
+        return;
+    }
+
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void*)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+#endif // DEBUG_LOG_GC
+
+    pushGray(worker, object);
+}
+
+/**
+ * blacken objects until every deque is empty and no worker is blackening,
+ * only the owner pushes to a deque, so an idle worker's deque stays empty
+ */
+static void drainGray(MarkWorker* worker, int count) {
+    currentWorker = worker;
+    for (;;) {
+        Obj* object;
+        while ((object = takeGray(worker)) != NULL) {
+            blackenObject(object);
+        }
+
+        object = stealFromOthers(worker, count);
+        if (object != NULL) {
+            blackenObject(object);
+            continue;
+        }
+
+        __atomic_add_fetch(&idleWorkers, 1, __ATOMIC_SEQ_CST);
+        while (!hasGray(count)) {
+            if (__atomic_load_n(&idleWorkers, __ATOMIC_SEQ_CST) == count) {
+                currentWorker = NULL;
+                return;
+            }
+            sched_yield();
+        }
+        __atomic_sub_fetch(&idleWorkers, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void* markWorkerMain(void* arg) {
+    MarkWorker* worker = (MarkWorker*) arg;
+    uint64_t round = worker->round;
+
+    pthread_mutex_lock(&markMutex);
+    for (;;) {
+        while (markRound == round && !stopWorkers) {
+            pthread_cond_wait(&markStart, &markMutex);
+        }
+        if (stopWorkers) break;
+
+        round = markRound;
+        int count = markThreads;
+        pthread_mutex_unlock(&markMutex);
+
+        // vm.gcMarkThreads减小后多出的线程不参与这一轮
+        if (worker - markWorkers < count) {
+            drainGray(worker, count);
+        }
+
+        pthread_mutex_lock(&markMutex);
+        finishedWorkers++;
+        pthread_cond_signal(&markDone);
+    }
+    pthread_mutex_unlock(&markMutex);
+    return NULL;
+}
+
+static int startMarkWorkers(int count) {
+    for (int i = 0; i < count; i++) {
+        if (markWorkers[i].array == NULL) {
+            markWorkers[i].array = newGrayArray(GRAY_ARRAY_INITIAL);
+            markWorkers[i].seed = (uint32_t)i + 1;
+        }
+    }
+
+    while (startedWorkers < count) {
+        MarkWorker* worker = &markWorkers[startedWorkers];
+        worker->round = markRound;
+        // 创建线程失败时用已有的线程标记
+        if (pthread_create(&worker->thread, NULL, markWorkerMain, worker) != 0) {
+            break;
+        }
+        startedWorkers++;
+    }
+    return startedWorkers < count ? startedWorkers : count;
+}
+
+static void stopMarkWorkers() {
+    pthread_mutex_lock(&markMutex);
+    stopWorkers = true;
+    pthread_cond_broadcast(&markStart);
+    pthread_mutex_unlock(&markMutex);
+
+    for (int i = 1; i < startedWorkers; i++) {
+        pthread_join(markWorkers[i].thread, NULL);
+    }
+    startedWorkers = 1;
+    stopWorkers = false;
+
+    for (int i = 0; i < GC_MARK_THREADS_MAX; i++) {
+        if (markWorkers[i].array != NULL) {
+            freeGrayArray(markWorkers[i].array);
+        }
+        free(markWorkers[i].retired);
+    }
+    memset(markWorkers, 0, sizeof(markWorkers));
+}
+
+/**
+ * trace from the gray stack filled by markRoots with vm.gcMarkThreads threads,
+ * the main thread works as worker 0 and returns once the whole heap is marked
+ */
+static void traceParallel() {
+    int count = vm.gcMarkThreads;
+    if (count < 1) count = 1;
+    if (count > GC_MARK_THREADS_MAX) count = GC_MARK_THREADS_MAX;
+    count = startMarkWorkers(count);
+
+    // 根对象轮流分给各个线程，其他线程还在等待，可以直接压入它们的队列
+    for (int i = 0; i < vm.grayCount; i++) {
+        pushGray(&markWorkers[i % count], vm.grayStack[i]);
+    }
+    vm.grayCount = 0;
+    idleWorkers = 0;
+
+    pthread_mutex_lock(&markMutex);
+    markThreads = count;
+    finishedWorkers = 0;
+    markRound++;
+    pthread_cond_broadcast(&markStart);
+    pthread_mutex_unlock(&markMutex);
+
+    drainGray(&markWorkers[0], count);
+
+    pthread_mutex_lock(&markMutex);
+    while (finishedWorkers < startedWorkers - 1) {
+        pthread_cond_wait(&markDone, &markMutex);
+    }
+    pthread_mutex_unlock(&markMutex);
+
+    for (int i = 0; i < count; i++) {
+        MarkWorker* worker = &markWorkers[i];
+        for (int j = 0; j < worker->retiredCount; j++) {
+            freeGrayArray(worker->retired[j]);
+        }
+        worker->retiredCount = 0;
+        worker->top = 0;
+        worker->bottom = 0;
+    }
+}
+#endif
+
 void markObject(Obj* object) {
     if (object == NULL) {
         return;
     }
+#ifdef PARALLEL_MARK
+    if (currentWorker != NULL) {
+        markParallel(currentWorker, object);
+        return;
+    }
+#endif
     // skip marked object
-    if (object->isMarked) {
+    if (setMarked(object)) {
         return;
     }
 
@@ -115,8 +1008,6 @@ void markObject(Obj* object) {
     printf("\n");
 #endif // DEBUG_LOG_GC
 
-    object->isMarked = true;
-
     // record gray object
     if (vm.grayCount + 1 > vm.grayCapacity) {
         vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
@@ -137,6 +1028,13 @@ void markValue(Value value) {
     }
 }
 
+static void markArray(ValueArray* array) {
+    int count = LOAD_PUBLISHED(array->count);
+    for (int i = 0; i < count; i++) {
+        markValue(array->values[i]);
+    }
+}
+
 static void markRoots() {
     // mark stack
     for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
@@ -149,21 +1047,19 @@ static void markRoots() {
     }
 
     // mark open values
-    for (ObjUpvalue* upvalue = vm.openValues; upvalue != NULL; upvalue = upvalue->next) {
-        markObject((Obj*)upvalue);
+    for (int i = 0; i < vm.openTop; i++) {
+        markObject((Obj*)vm.openUpvalues[i]);
     }
 
     markTable(&vm.globals);
+    markArray(&vm.globalValues);
+    markArray(&vm.globalNames);
 
     markObject((Obj*)vm.initString);
 
-    markCompilerRoots();
-}
+    markObject((Obj*)vm.rootShape);
 
-static void markArray(ValueArray* array) {
-    for (int i = 0; i < array->count; i++) {
-        markValue(array->values[i]);
-    }
+    markCompilerRoots();
 }
 
 static void blackenObject(Obj* object) {
@@ -176,7 +1072,9 @@ static void blackenObject(Obj* object) {
     switch (object->type)
     {
     case OBJ_STRING:
+        break;
     case OBJ_NATIVE:
+        markObject((Obj*)((ObjNative*)object)->name);
         break;
     case OBJ_UPVALUE:
         markValue(((ObjUpvalue*)object)->closed);
@@ -186,13 +1084,36 @@ static void blackenObject(Obj* object) {
         ObjFunction* function = (ObjFunction*)object;
         markObject((Obj*)function->name);
         markArray(&function->chunk.constants);
+        // 缓存中的类可能被回收后地址重用，保持其存活
+        int cacheCount = LOAD_PUBLISHED(function->chunk.cacheCount);
+        for (int i = 0; i < cacheCount; i++) {
+            InlineCache* cache = &function->chunk.caches[i];
+            for (int j = 0; j < INLINE_CACHE_SIZE; j++) {
+                markObject((Obj*)cache->entries[j].klass);
+                markObject((Obj*)cache->entries[j].shape);
+                markObject((Obj*)cache->entries[j].transition);
+                markObject((Obj*)cache->entries[j].method);
+            }
+        }
+        int callCacheCount = LOAD_PUBLISHED(function->chunk.callCacheCount);
+        for (int i = 0; i < callCacheCount; i++) {
+            markObject(function->chunk.callCaches[i].callee);
+            markObject((Obj*)function->chunk.callCaches[i].closure);
+        }
         break;
     }
     case OBJ_CLOSURE: {
         ObjClosure* closure = (ObjClosure*) object;
         markObject((Obj*)closure->function);
         for (int i = 0; i < closure->upvalueCount; i++) {
-            markObject((Obj*)closure->upvalues[i]);
+            // values在upvalues[i]指向它之前发布，先读取upvalue
+            ObjUpvalue* upvalue = LOAD_PUBLISHED(closure->upvalues[i]);
+            ObjUpvalue* values = LOAD_PUBLISHED(closure->values);
+            if (values != NULL && upvalue >= values && upvalue < values + closure->upvalueCount) {
+                markValue(upvalue->closed);
+            } else {
+                markObject((Obj*)upvalue);
+            }
         }
         break;
     }
@@ -205,10 +1126,27 @@ static void blackenObject(Obj* object) {
     case OBJ_INSTANCE: {
         ObjInstance* instance = (ObjInstance*)object;
         markObject((Obj*)instance->klass);
+        // 新字段写入slots之后才发布新的shape
+        ObjShape* shape = LOAD_PUBLISHED(instance->shape);
+        if (shape != NULL) {
+            markObject((Obj*)shape);
+            for (int i = 0; i < shape->fieldCount; i++) {
+                markValue(instance->slots[i]);
+            }
+        }
         markTable(&instance->fields);
         break;
     }
 
+    case OBJ_SHAPE: {
+        ObjShape* shape = (ObjShape*)object;
+        markObject((Obj*)shape->parent);
+        markObject((Obj*)shape->name);
+        markTable(&shape->slots);
+        markTable(&shape->transitions);
+        break;
+    }
+
     case OBJ_BOUND_METHOD: {
         ObjBoundMethod* bound = (ObjBoundMethod*)object;
         markValue(bound->receiver);
@@ -221,59 +1159,711 @@ static void blackenObject(Obj* object) {
     }
 }
 
-static void traceReferences() {
-    while (vm.grayCount > 0) {
+static void traceReferences(int budget) {
+    while (vm.grayCount > 0 && budget-- > 0) {
         Obj* object = vm.grayStack[--vm.grayCount];
         blackenObject(object);
     }
 }
 
-static void sweep() {
-    Obj* previous = NULL;
-    Obj* object = vm.objects;
+#ifdef CONCURRENT_MARK
+/*
+ * 并发标记：标记根对象后由后台线程追踪灰色对象，解释器同时运行。标记线程每次持有堆锁
+ * 标记一批对象，解释器在替换标记线程可能读取的数组以及标记对象时加锁。覆盖引用前
+ * 标记旧的对象(satbBarrier)，标记开始时可达的对象都会被标记，期间分配的对象为黑色
+ */
+#define MARKER_BATCH 256
 
-    // free and delete unmarked object from linked list object
-    while (object != NULL) {
-        if (object->isMarked) {
-            // flip isMarked for next round of collection
-            object->isMarked = false;
+static pthread_mutex_t heapMutex = PTHREAD_MUTEX_INITIALIZER;
+// 等待堆锁的解释器线程数，标记线程在两批之间等它们拿到锁
+static int heapWaiters;
 
-            // skip marked object
-            previous = object;
-            object = object->next;
-        } else {
-            Obj* unreached = object;
-            object = object->next;
+static pthread_t markerThread;
+static bool markerStarted;
+static pthread_cond_t markerWake = PTHREAD_COND_INITIALIZER;
+// 以下由heapMutex保护
+static bool markerActive;
+static bool markerStop;
+// 标记线程已经处理完灰色对象，解释器在下一个回收片段结束标记
+static bool markerDone;
 
-            if (previous != NULL) {
-                previous->next = object->next;
-            } else {
-                vm.objects = object->next;
-            }
+void lockHeap() {
+    __atomic_add_fetch(&heapWaiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&heapMutex);
+    __atomic_sub_fetch(&heapWaiters, 1, __ATOMIC_SEQ_CST);
+}
 
-            freeObject(unreached);
+void unlockHeap() {
+    pthread_mutex_unlock(&heapMutex);
+}
+
+void shadeObject(Obj* object) {
+    lockHeap();
+    markObject(object);
+    unlockHeap();
+}
+
+static void* markerMain(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&heapMutex);
+    for (;;) {
+        while (!markerActive && !markerStop) {
+            pthread_cond_wait(&markerWake, &heapMutex);
+        }
+        if (markerStop) break;
+
+        traceReferences(MARKER_BATCH);
+        if (vm.grayCount == 0) {
+            markerActive = false;
+            __atomic_store_n(&markerDone, true, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        pthread_mutex_unlock(&heapMutex);
+        while (__atomic_load_n(&heapWaiters, __ATOMIC_SEQ_CST) > 0) {
+            sched_yield();
         }
+        pthread_mutex_lock(&heapMutex);
     }
+    pthread_mutex_unlock(&heapMutex);
+    return NULL;
 }
 
-void collectGarbage() {
+// called with the heap locked after marking the roots
+static void startMarker() {
+    if (!markerStarted) {
+        // 创建线程失败时由回收片段增量标记
+        markerStarted = pthread_create(&markerThread, NULL, markerMain, NULL) == 0;
+        if (!markerStarted) return;
+    }
+
+    __atomic_store_n(&markerDone, false, __ATOMIC_RELAXED);
+    markerActive = true;
+    pthread_cond_signal(&markerWake);
+}
+
+static void stopMarker() {
+    if (!markerStarted) return;
+
+    lockHeap();
+    markerStop = true;
+    markerActive = false;
+    pthread_cond_signal(&markerWake);
+    unlockHeap();
+
+    pthread_join(markerThread, NULL);
+    markerStarted = false;
+    markerStop = false;
+}
+#endif
+
+#ifdef GENERATIONAL_GC
+// 标记不移动对象，新生代对象同样标记，但由下一次新生代回收释放
+static void finishNurseryMarks() {
+    // 已经回收的老年代对象不能留在remembered中
+    int count = 0;
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        if (isMarked(vm.remembered[i])) {
+            vm.remembered[count++] = vm.remembered[i];
+        }
+    }
+    vm.rememberedCount = count;
+
+    memset(vm.nurseryMarks, 0, NURSERY_MARK_WORDS * sizeof(uint64_t));
+}
+#endif
+
+#ifdef DEBUG_PROFILE_GC
+typedef struct {
+    uint64_t count;
+    double total;
+    double longest;
+} GcPauses;
+
+static GcPauses slicePauses;
+#ifdef GENERATIONAL_GC
+static GcPauses nurseryPauses;
+#endif
+#ifdef PARALLEL_MARK
+static GcPauses markPauses;
+#endif
+#ifdef CONCURRENT_MARK
+static GcPauses remarkPauses;
+#endif
+#ifdef COMPACT_GC
+static GcPauses compactPauses;
+#endif
+
+// wall clock in milliseconds, clock() would add up the cpu time of all marking threads
+static double profileClock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec * 1000.0 + (double)now.tv_nsec / 1000000.0;
+}
+
+static void recordPause(GcPauses* pauses, double start) {
+    double pause = profileClock() - start;
+    pauses->count++;
+    pauses->total += pause;
+    if (pause > pauses->longest) {
+        pauses->longest = pause;
+    }
+}
+
+static void printPauses(const char* name, GcPauses* pauses) {
+    printf("%s: %llu pauses, total %.3f ms, longest %.3f ms, average %.3f ms\n",
+           name, (unsigned long long)pauses->count, pauses->total, pauses->longest,
+           pauses->count == 0 ? 0.0 : pauses->total / (double)pauses->count);
+}
+
+void printGcProfile() {
+    printf("== gc pauses ==\n");
+    printPauses("slice", &slicePauses);
+#ifdef GENERATIONAL_GC
+    printPauses("nursery", &nurseryPauses);
+#endif
+#ifdef PARALLEL_MARK
+    printf("mark threads: %d\n", vm.gcMarkThreads);
+    printPauses("mark", &markPauses);
+#endif
+#ifdef CONCURRENT_MARK
+    printPauses("remark", &remarkPauses);
+#endif
+#ifdef COMPACT_GC
+    printPauses("compact", &compactPauses);
+#endif
+}
+#endif
+
+#ifdef DEBUG_LOG_GC
+static size_t cycleStartBytes;
+#endif
+
+static void beginCycle() {
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
-    size_t before = vm.bytesAllocated;
+    cycleStartBytes = vm.bytesAllocated;
 #endif // DEBUG_LOG_GC
 
+    vm.gcPhase = GC_MARK;
+#ifdef CONCURRENT_MARK
+    // 只在标记根对象时暂停，之后由标记线程和解释器并发标记
+    lockHeap();
+    markRoots();
+    startMarker();
+    unlockHeap();
+#else
+    markRoots();
+#endif
+
+#ifdef PARALLEL_MARK
+    // 并行标记在这一次暂停中完成，之后的片段只做清除
+#ifdef DEBUG_PROFILE_GC
+    double start = profileClock();
+#endif
+    traceParallel();
+    finishMark();
+#ifdef DEBUG_PROFILE_GC
+    recordPause(&markPauses, start);
+#endif
+#endif
+}
+
+/**
+ * the stack and other roots are written without the incremental barrier, mark
+ * them again and finish tracing in one go, then drop unmarked strings and
+ * start sweeping
+ */
+static void finishMark() {
+#ifdef CONCURRENT_MARK
+    // 根对象不用重新标记：标记开始时已经标记，之后分配的对象为黑色，被覆盖的引用由
+    // satbBarrier标记。停下标记线程，追踪它还没有处理的灰色对象
+    lockHeap();
+    markerActive = false;
+    traceReferences(INT_MAX);
+    unlockHeap();
+#else
     markRoots();
-    traceReferences();
+    traceReferences(INT_MAX);
+#endif
     tableRemoveWhile(&vm.strings);
-    sweep();
+#ifdef GENERATIONAL_GC
+    finishNurseryMarks();
+#endif
+
+    // 清除期间只在已经清除的页和新的页中分配，新分配的对象不会被这一轮清除
+    for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+        SizeClass* klass = &vm.sizeClasses[i];
+        klass->sweepPages = klass->pages;
+        klass->pages = NULL;
+        klass->freePages = NULL;
+    }
+    vm.gcPhase = GC_SWEEP;
+#ifdef BACKGROUND_SWEEP
+    startSweeper();
+#endif
+}
 
+#ifdef CONCURRENT_MARK
+/**
+ * the marker ran out of gray objects, end marking unless the barrier shaded
+ * more since then. those go back to the marker and we check again in a later
+ * slice, so the pause never traces anything
+ */
+static void remark() {
+#ifdef DEBUG_PROFILE_GC
+    double start = profileClock();
+#endif
+
+    lockHeap();
+    bool done = vm.grayCount == 0;
+    if (!done) {
+        startMarker();
+    }
+    unlockHeap();
+    if (done) {
+        finishMark();
+    }
+
+#ifdef DEBUG_PROFILE_GC
+    recordPause(&remarkPauses, start);
+#endif
+}
+#endif
+
+static void finishSweep() {
+    vm.gcPhase = GC_IDLE;
     vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+#ifdef COMPACT_GC
+    checkFragmentation();
+#endif
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
     printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-         before - vm.bytesAllocated, before, vm.bytesAllocated,
+         cycleStartBytes - vm.bytesAllocated, cycleStartBytes, vm.bytesAllocated,
          vm.nextGC);
 #endif // DEBUG_LOG_GC
+}
+
+#ifdef BACKGROUND_SWEEP
+/*
+ * 后台清除：标记结束后把所有sweepPages交给清除线程，每清除完一页就放到sweptPages中，
+ * 由解释器线程取回。清除期间解释器只在取回的页和新的页中分配，不会开始新一轮回收，
+ * 清除线程只修改交给它的页
+ */
+static pthread_t sweeperThread;
+static pthread_mutex_t sweepMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sweepStart = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t sweepDone = PTHREAD_COND_INITIALIZER;
+// 以下由sweepMutex保护
+static Page* sweeperPages;
+static Page* sweptPages;
+static bool sweeperBusy;
+static bool sweeperStop;
+
+static void* sweeperMain(void* arg) {
+    (void)arg;
+    inSweeper = true;
+
+    pthread_mutex_lock(&sweepMutex);
+    for (;;) {
+        while (!sweeperBusy && !sweeperStop) {
+            pthread_cond_wait(&sweepStart, &sweepMutex);
+        }
+        if (sweeperStop) break;
+
+        Page* pages = sweeperPages;
+        sweeperPages = NULL;
+        while (pages != NULL) {
+            Page* page = pages;
+            pages = page->next;
+            pthread_mutex_unlock(&sweepMutex);
+
+            sweepPage(page);
+
+            pthread_mutex_lock(&sweepMutex);
+            page->next = sweptPages;
+            sweptPages = page;
+        }
+
+        sweeperBusy = false;
+        pthread_cond_signal(&sweepDone);
+    }
+    pthread_mutex_unlock(&sweepMutex);
+    return NULL;
+}
+
+// hand every sweepPages over to the sweeper thread, false if it can't be started
+static bool startSweeper() {
+    if (!sweeperStarted) {
+        sweeperStarted = pthread_create(&sweeperThread, NULL, sweeperMain, NULL) == 0;
+        if (!sweeperStarted) return false;
+    }
+
+    Page* pages = NULL;
+    for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+        SizeClass* klass = &vm.sizeClasses[i];
+        while (klass->sweepPages != NULL) {
+            Page* page = klass->sweepPages;
+            klass->sweepPages = page->next;
+            page->next = pages;
+            pages = page;
+        }
+    }
+
+    pthread_mutex_lock(&sweepMutex);
+    sweeperPages = pages;
+    sweeperBusy = true;
+    pthread_cond_signal(&sweepStart);
+    pthread_mutex_unlock(&sweepMutex);
+    return true;
+}
+
+/**
+ * take back the pages swept so far and fold the bytes freed by the sweeper
+ * into vm.bytesAllocated, finish the cycle once the sweeper is done
+ * @param wait block until the sweeper is done
+ */
+static void pollSweeper(bool wait) {
+    pthread_mutex_lock(&sweepMutex);
+    while (wait && sweeperBusy) {
+        pthread_cond_wait(&sweepDone, &sweepMutex);
+    }
+    bool done = !sweeperBusy;
+    Page* pages = sweptPages;
+    sweptPages = NULL;
+    pthread_mutex_unlock(&sweepMutex);
+
+    vm.bytesAllocated -= __atomic_exchange_n(&sweptBytes, 0, __ATOMIC_RELAXED);
+    while (pages != NULL) {
+        Page* page = pages;
+        pages = page->next;
+        keepPage(page);
+    }
+
+    if (done) {
+        finishSweep();
+    }
+}
+
+static void stopSweeper() {
+    if (!sweeperStarted) return;
+
+    if (vm.gcPhase == GC_SWEEP) {
+        pollSweeper(true);
+    }
+
+    pthread_mutex_lock(&sweepMutex);
+    sweeperStop = true;
+    pthread_cond_signal(&sweepStart);
+    pthread_mutex_unlock(&sweepMutex);
+
+    pthread_join(sweeperThread, NULL);
+    sweeperStarted = false;
+    sweeperStop = false;
+}
+#endif
+
+// sweep the pages of sweepPages until budget cells are visited
+static void sweep(int budget) {
+#ifdef BACKGROUND_SWEEP
+    // sweepPages已经交给清除线程
+    if (sweeperStarted) {
+        pollSweeper(budget == INT_MAX);
+        return;
+    }
+#endif
+    for (int i = 0; i < HEAP_SIZE_CLASSES && budget > 0; i++) {
+        SizeClass* klass = &vm.sizeClasses[i];
+        while (klass->sweepPages != NULL && budget > 0) {
+            Page* page = klass->sweepPages;
+            klass->sweepPages = page->next;
+            budget -= page->cellCount;
+            sweepPage(page);
+            keepPage(page);
+        }
+    }
+
+    if (!hasSweepPages()) {
+        finishSweep();
+    }
+}
+
+static void finishCycle() {
+    if (vm.gcPhase == GC_MARK) {
+        finishMark();
+    }
+    sweep(INT_MAX);
+}
+
+// finish the cycle in progress, then collect the whole heap without slicing
+void collectGarbage() {
+    if (vm.gcPhase != GC_IDLE) {
+        finishCycle();
+    }
+    beginCycle();
+    finishCycle();
+}
+
+/**
+ * do at most vm.gcSliceBudget objects of marking or sweeping, the mutator runs
+ * between slices and the write barrier keeps black objects off white ones
+ */
+static void collectSlice() {
+#ifdef DEBUG_PROFILE_GC
+    double start = profileClock();
+#endif
+
+    if (vm.gcSliceBudget <= 0) {
+        if (vm.gcPhase == GC_IDLE) {
+            beginCycle();
+        }
+        finishCycle();
+    } else {
+        switch (vm.gcPhase) {
+            case GC_IDLE:
+                beginCycle();
+                break;
+            case GC_MARK:
+#ifdef CONCURRENT_MARK
+                if (markerStarted) {
+                    if (__atomic_load_n(&markerDone, __ATOMIC_ACQUIRE)) {
+                        remark();
+                    }
+                    break;
+                }
+#endif
+                traceReferences(vm.gcSliceBudget);
+                if (vm.grayCount == 0) {
+                    finishMark();
+                }
+                break;
+            case GC_SWEEP:
+                sweep(vm.gcSliceBudget);
+                break;
+        }
+    }
+
+#ifdef DEBUG_PROFILE_GC
+    recordPause(&slicePauses, start);
+#endif
+}
+
+#ifdef GENERATIONAL_GC
+/**
+ * copy the young objects reachable from roots and remembered old objects to
+ * the old generation, then reuse the whole nursery. promotion moves objects,
+ * so this only runs at safepoints in run() where no C local holds an object
+ */
+void collectNursery() {
+#ifdef DEBUG_LOG_GC
+    printf("-- nursery gc begin\n");
+    size_t used = (size_t)(vm.nurseryTop - vm.nursery);
+#endif // DEBUG_LOG_GC
+#ifdef DEBUG_PROFILE_GC
+    double start = profileClock();
+#endif
+
+    forwardRoots();
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        vm.remembered[i]->isRemembered = false;
+        forwardReferences(vm.remembered[i]);
+    }
+    vm.rememberedCount = 0;
+    // 晋升的对象可能还引用新生代对象
+    while (promotedCount > 0) {
+        forwardReferences(promoted[--promotedCount]);
+    }
+    forwardStrings();
+
+    releaseNursery();
+    vm.nurseryTop = vm.nursery;
+    vm.nurseryFull = false;
+    // 旧的标记位不能留给之后分配在同一地址的对象
+    if (vm.gcPhase == GC_MARK) {
+        memset(vm.nurseryMarks, 0, NURSERY_MARK_WORDS * sizeof(uint64_t));
+    }
+
+#ifdef DEBUG_PROFILE_GC
+    recordPause(&nurseryPauses, start);
+#endif
+#ifdef DEBUG_LOG_GC
+    printf("-- nursery gc end\n");
+    printf("   released %zu bytes of nursery\n", used);
+#endif // DEBUG_LOG_GC
+
+    if (vm.gcPhase != GC_IDLE || vm.bytesAllocated > vm.nextGC) {
+        collectSlice();
+    }
+}
+#endif
+
+#ifdef COMPACT_GC
+// 完整回收结束时存活对象只占用页空间的一小部分，在下一个安全点整理堆
+static void checkFragmentation() {
+#ifdef DEBUG_STRESS_GC
+    // 每轮回收之后都整理
+    vm.compactRequested = true;
+#else
+    if (vm.compactThreshold <= 0) return;
+
+    size_t live = 0;
+    size_t capacity = 0;
+    int pageCount = 0;
+    for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+        for (Page* page = vm.sizeClasses[i].pages; page != NULL; page = page->next) {
+            live += (size_t)page->liveCount * page->cellSize;
+            capacity += (size_t)page->cellCount * page->cellSize;
+            pageCount++;
+        }
+    }
+
+    if (pageCount >= COMPACT_MIN_PAGES && live * 100 < capacity * (size_t)vm.compactThreshold) {
+        vm.compactRequested = true;
+    }
+#endif // DEBUG_STRESS_GC
+}
+
+static int compareLiveCount(const void* a, const void* b) {
+    const Page* left = *(Page* const*)a;
+    const Page* right = *(Page* const*)b;
+    return right->liveCount - left->liveCount;
+}
+
+/**
+ * keep the fewest, fullest pages of the size class that hold all of its
+ * objects, move the objects of the other pages into their free cells
+ * @return evacuated with the emptied pages added
+ */
+static Page* evacuateClass(SizeClass* klass, Page* evacuated) {
+    int pageCount = 0;
+    size_t live = 0;
+    for (Page* page = klass->pages; page != NULL; page = page->next) {
+        pageCount++;
+        live += page->liveCount;
+    }
+    if (pageCount < 2) return evacuated;
+
+    int cellCount = klass->pages->cellCount;
+    int keep = live == 0 ? 1 : (int)((live + cellCount - 1) / cellCount);
+    if (keep >= pageCount) return evacuated;
+
+    Page** pages = (Page**)malloc(sizeof(Page*) * pageCount);
+    if (pages == NULL) exit(1);
+    int count = 0;
+    for (Page* page = klass->pages; page != NULL; page = page->next) {
+        pages[count++] = page;
+    }
+    qsort(pages, pageCount, sizeof(Page*), compareLiveCount);
+
+    klass->pages = NULL;
+    klass->freePages = NULL;
+    for (int i = keep - 1; i >= 0; i--) {
+        pages[i]->next = klass->pages;
+        klass->pages = pages[i];
+        if (pages[i]->liveCount < pages[i]->cellCount) {
+            pages[i]->nextCell = 0;
+            pages[i]->nextFree = klass->freePages;
+            klass->freePages = pages[i];
+        }
+    }
+
+    // 留下的页的空闲单元足够放下其他页中的对象，takeCell不会分配新的页
+    for (int i = keep; i < pageCount; i++) {
+        Page* page = pages[i];
+        for (int granule = 0; granule < PAGE_GRANULES; granule++) {
+            if (!IS_USED(page, granule)) continue;
+
+            Obj* object = CELL_AT(page, granule);
+            Obj* copy = takeCell(page->sizeClass);
+            memcpy(copy, object, objectSize(object));
+            // closed upvalue points to its own closed field
+            if (object->type == OBJ_UPVALUE) {
+                ObjUpvalue* upvalue = (ObjUpvalue*)object;
+                if (upvalue->location == &upvalue->closed) {
+                    ((ObjUpvalue*)copy)->location = &((ObjUpvalue*)copy)->closed;
+                }
+            }
+#ifdef DEBUG_LOG_GC
+            printf("%p move to %p type %d\n", (void*)object, (void*)copy, object->type);
+#endif
+            *(Obj**)object = copy;
+        }
+        page->evacuated = true;
+        page->next = evacuated;
+        evacuated = page;
+    }
+
+    free(pages);
+    return evacuated;
+}
+
+/**
+ * mark-compact: after a full collection the objects of the sparse pages of
+ * every size class move into the free cells of the full ones and leave their
+ * new address behind, then the roots and every object are updated like in a
+ * nursery collection and the emptied pages go back to the system
+ */
+void compactHeap() {
+#ifdef DEBUG_LOG_GC
+    printf("-- compact begin\n");
+#endif // DEBUG_LOG_GC
+#ifdef DEBUG_PROFILE_GC
+    double start = profileClock();
+#endif
+
+#ifdef GENERATIONAL_GC
+    // 新生代对象先晋升，整理时只有老年代对象
+    collectNursery();
+#endif
+    collectGarbage();
+
+    Page* evacuated = NULL;
+    for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+        evacuated = evacuateClass(&vm.sizeClasses[i], evacuated);
+    }
+
+    int freed = 0;
+    if (evacuated != NULL) {
+        compacting = true;
+        forwardRoots();
+        // 完整回收后驻留表中只有存活的字符串
+        forwardTable(&vm.strings);
+#ifdef GENERATIONAL_GC
+        for (int i = 0; i < vm.rememberedCount; i++) {
+            FORWARD(vm.remembered[i]);
+        }
+#endif
+        for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+            for (Page* page = vm.sizeClasses[i].pages; page != NULL; page = page->next) {
+                for (int granule = 0; granule < PAGE_GRANULES; granule++) {
+                    if (IS_USED(page, granule)) {
+                        forwardReferences(CELL_AT(page, granule));
+                    }
+                }
+            }
+        }
+        compacting = false;
 
+        // 对象已经移走，不释放它们的数组
+        while (evacuated != NULL) {
+            Page* page = evacuated;
+            evacuated = page->next;
+            freePage(page);
+            freed++;
+        }
+    }
+    vm.compactRequested = false;
+
+#ifdef DEBUG_PROFILE_GC
+    recordPause(&compactPauses, start);
+#endif
+#ifdef DEBUG_LOG_GC
+    printf("-- compact end\n");
+    printf("   released %d pages\n", freed);
+#else
+    (void)freed;
+#endif // DEBUG_LOG_GC
 }
+#endif
@@ -1,6 +1,8 @@
 #ifndef clox_memory_h
 #define clox_memory_h
 
+#include <string.h>
+
 #include "common.h"
 #include "object.h"
 #include "vm.h"
@@ -18,14 +20,215 @@
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
+#ifdef CONCURRENT_MARK
+/*
+ * 标记线程持有堆锁时读取对象，扩容它可能正在读取的数组时先分配并复制，
+ * 在锁内替换指针后再释放旧数组
+ */
+#define GROW_SHARED_ARRAY(type, pointer, oldCount, newCount) \
+    do { \
+        type* grown = ALLOCATE(type, newCount); \
+        if ((oldCount) > 0) memcpy(grown, pointer, sizeof(type) * (oldCount)); \
+        type* old = pointer; \
+        lockHeap(); \
+        pointer = grown; \
+        unlockHeap(); \
+        FREE_ARRAY(type, old, oldCount); \
+    } while (false)
+
+// 先写入内容再发布指向它的指针或者计数，标记线程不会读到未初始化的内容
+#define PUBLISH(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELEASE)
+#define LOAD_PUBLISHED(field) __atomic_load_n(&(field), __ATOMIC_ACQUIRE)
+#else
+#define GROW_SHARED_ARRAY(type, pointer, oldCount, newCount) \
+    ((pointer) = GROW_ARRAY(type, pointer, oldCount, newCount))
+
+#define PUBLISH(field, value) ((field) = (value))
+#define LOAD_PUBLISHED(field) (field)
+#endif
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
 
 void collectGarbage();
 
+#ifdef COMPACT_GC
+// collect the whole heap and move objects out of the sparse pages, only at safepoints of run()
+void compactHeap();
+#endif
+
+// an object of size bytes in the old generation, see the pages in memory.c
+void* allocateCell(size_t size);
+
+#ifdef GENERATIONAL_GC
+// 新生代越大，回收前有越多临时对象来得及死亡，回收的代价主要是复制存活的对象
+#ifndef NURSERY_SIZE
+#define NURSERY_SIZE (4 * 1024 * 1024)
+#endif
+
+#define IS_YOUNG(object) \
+    ((uintptr_t)((uint8_t*)(object) - vm.nursery) < NURSERY_SIZE)
+
+// 新生代对象按8字节对齐，每8字节一个标记位
+#define NURSERY_MARK_WORDS (NURSERY_SIZE / 8 / 64)
+
+Obj* allocateNursery(size_t size);
+
+void collectNursery();
+
+void rememberObject(Obj* object);
+#endif
+
+/*
+ * 老年代对象按大小分类分配在HEAP_PAGE_SIZE对齐的堆页中，一页只放同一类的对象。
+ * 堆页开头只有一个指向页描述符的指针，创建时写入一次。链表、计数以及used和marks
+ * 位图都在单独分配的描述符中，每HEAP_CELL_ALIGN字节在两个位图中各有一位，分别表示
+ * 从这里开始的单元中有对象和对象已经标记。回收时不写入堆页，fork出的进程和父进程
+ * 共享的老年代内存页只在对象本身被修改或者单元被重新分配时才复制
+ */
+#define HEAP_PAGE_SIZE (16 * 1024)
+#define PAGE_GRANULES (HEAP_PAGE_SIZE / HEAP_CELL_ALIGN)
+#define PAGE_BITMAP_WORDS (PAGE_GRANULES / 64)
+
+struct Page {
+    // 同一类的pages或者sweepPages链表
+    struct Page* next;
+    // 同一类的freePages链表
+    struct Page* nextFree;
+    // 堆页和其中的第一个单元
+    uint8_t* base;
+    uint8_t* cells;
+    // 从这个单元开始查找空闲单元，之前的单元都已经分配
+    int nextCell;
+    int sizeClass;
+    int cellSize;
+    int cellCount;
+    int liveCount;
+    uint64_t used[PAGE_BITMAP_WORDS];
+    uint64_t marks[PAGE_BITMAP_WORDS];
+#ifdef COMPACT_GC
+    // 整理时页中的对象都已经移走，原单元的第一个字是新地址
+    bool evacuated;
+#endif
+};
+
+#define PAGE_BASE(object) ((uint8_t*)((uintptr_t)(object) & ~(uintptr_t)(HEAP_PAGE_SIZE - 1)))
+#define PAGE_OF(object) (*(Page**)PAGE_BASE(object))
+
+typedef struct {
+    uint64_t* word;
+    uint64_t mask;
+} MarkBit;
+
+// the mark bit of object, in the bitmap of its page or of the nursery
+static inline MarkBit markBitOf(Obj* object) {
+    size_t index;
+    uint64_t* marks;
+#ifdef GENERATIONAL_GC
+    if (IS_YOUNG(object)) {
+        index = (size_t)((uint8_t*)object - vm.nursery) / 8;
+        marks = vm.nurseryMarks;
+    } else
+#endif
+    {
+        index = ((uintptr_t)object & (HEAP_PAGE_SIZE - 1)) / HEAP_CELL_ALIGN;
+        marks = PAGE_OF(object)->marks;
+    }
+    MarkBit bit = {&marks[index / 64], (uint64_t)1 << (index % 64)};
+    return bit;
+}
+
+static inline bool isMarked(Obj* object) {
+    MarkBit bit = markBitOf(object);
+#if defined(PARALLEL_MARK) || defined(CONCURRENT_MARK)
+    return (__atomic_load_n(bit.word, __ATOMIC_RELAXED) & bit.mask) != 0;
+#else
+    return (*bit.word & bit.mask) != 0;
+#endif
+}
+
+/**
+ * set the mark bit of object
+ * @return whether it was already set
+ */
+static inline bool setMarked(Obj* object) {
+    MarkBit bit = markBitOf(object);
+#if defined(PARALLEL_MARK) || defined(CONCURRENT_MARK)
+    // 同一个字中的其他位可能同时被其他线程设置
+    return (__atomic_fetch_or(bit.word, bit.mask, __ATOMIC_RELAXED) & bit.mask) != 0;
+#else
+    bool marked = (*bit.word & bit.mask) != 0;
+    *bit.word |= bit.mask;
+    return marked;
+#endif
+}
+
+// barrier for every entry of a table filled in one go, like tableAddAll
+void writeBarrierTable(Obj* owner, Table* table);
+
+#ifdef DEBUG_PROFILE_GC
+void printGcProfile();
+#endif
+
 void freeObjects();
 
 void markObject(Obj* object);
 
 void markValue(Value value);
 
+#ifdef CONCURRENT_MARK
+void lockHeap();
+
+void unlockHeap();
+
+void shadeObject(Obj* object);
+#endif
+
+/**
+ * every store of a reference into a heap object goes through here, owner is
+ * the object written to. stores into the stack, globals and other roots don't,
+ * the roots are marked again at the end of marking instead
+ */
+static inline void writeBarrier(Obj* owner, Value value) {
+#ifdef CONCURRENT_MARK
+    // 并发标记由satbBarrier保证，标记期间新对象分配为黑色
+    (void)owner;
+    (void)value;
+#else
+    // 增量标记期间已经标记的对象不能引用白色对象，写入时标记新引用的对象(Dijkstra)
+    if (vm.gcPhase == GC_MARK && IS_OBJ(value) && isMarked(owner)) {
+        markObject(AS_OBJ(value));
+    }
+#endif
+#ifdef GENERATIONAL_GC
+    if (IS_OBJ(value) && IS_YOUNG(AS_OBJ(value)) && !IS_YOUNG(owner) && !owner->isRemembered) {
+        rememberObject(owner);
+    }
+#endif
+}
+
+/**
+ * snapshot-at-the-beginning barrier of the concurrent marker, called with the
+ * old reference before a heap object overwrites it, so that every object
+ * reachable when marking began gets marked even if the marker hasn't got there
+ */
+static inline void satbBarrierObject(Obj* old) {
+#ifdef CONCURRENT_MARK
+    if (vm.gcPhase == GC_MARK && old != NULL && !isMarked(old)) {
+        shadeObject(old);
+    }
+#else
+    (void)old;
+#endif
+}
+
+static inline void satbBarrier(Value old) {
+#ifdef CONCURRENT_MARK
+    if (IS_OBJ(old)) {
+        satbBarrierObject(AS_OBJ(old));
+    }
+#else
+    (void)old;
+#endif
+}
+
 #endif
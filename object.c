@@ -14,13 +14,33 @@
 #define ALLOCATE_OBJ(type, objType) (type*)allocateObject(sizeof(type), objType)
 
 static Obj* allocateObject(size_t size, ObjType type) {
-    Obj* object = (Obj*) reallocate(NULL, 0, size);
+#ifdef GENERATIONAL_GC
+    Obj* object = allocateNursery(size);
+    bool isYoung = object != NULL;
+    if (!isYoung) {
+        object = (Obj*)allocateCell(size);
+    }
+#else
+    Obj* object = (Obj*)allocateCell(size);
+#endif
     object->type = type;
-    object->isMarked = false;
+#ifdef CONCURRENT_MARK
+    // 并发标记期间分配的对象直接为黑色，标记线程不需要扫描，
+    // 标记线程通过之后写入的引用看到这个对象时，对象头已经写入
+    if (vm.gcPhase == GC_MARK) {
+        setMarked(object);
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+#endif
 
-    // tracks every allocated obj
-    object->next = vm.objects;
-    vm.objects = object;
+#ifdef GENERATIONAL_GC
+    object->isRemembered = false;
+    object->forward = NULL;
+    if (!isYoung) {
+        // 新生代已满时分配到老年代，初始化时写入的新生代引用不经过写屏障，直接记录
+        rememberObject(object);
+    }
+#endif
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -33,6 +53,11 @@ ObjFunction* newFunction() {
     function->arity = 0;
     function->name = NULL;
     function->upvalueCount = 0;
+    function->maxSlots = 0;
+#ifdef CLOX_JIT
+    function->hotness = 0;
+    function->jit = NULL;
+#endif
     initChunk(&function->chunk);
     return function;
 }
@@ -64,7 +89,11 @@ ObjString* copyString(const char* chars, int length) {
     uint32_t hash = hashString(chars, length);
     ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
 
-    if (interned != NULL) {return interned;}
+    if (interned != NULL) {
+        // 驻留表是弱引用，标记期间重新取得的字符串可能还没有标记
+        satbBarrierObject((Obj*)interned);
+        return interned;
+    }
 
     char* heapChars = ALLOCATE(char, length + 1);
     memcpy(heapChars, chars, length);
@@ -88,6 +117,7 @@ ObjString* takeString(const char* chars, int length) {
     if (interned != NULL) {
         // 获取了chars的所有权，需要释放掉
         FREE_ARRAY(char, chars, length);
+        satbBarrierObject((Obj*)interned);
         return interned;
     }
 
@@ -120,12 +150,18 @@ void printObject(Value value) {
         case OBJ_BOUND_METHOD:
             printFunction(AS_BOUND_METHOD(value)->method->function);
             break;
+        case OBJ_SHAPE:
+            printf("shape");
+            break;
     }
 }
 
-ObjNative* newNative(NativeFn function) {
+ObjNative* newNative(ObjString* name, int arity, NativeFn function, NumberNativeFn numberFunction) {
     ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function = function;
+    native->numberFunction = numberFunction;
+    native->arity = arity;
+    native->name = name;
     return native;
 }
 
@@ -139,13 +175,13 @@ ObjClosure* newClosure(ObjFunction* function) {
     closure->function = function;
     closure->upvalues = upvalues;
     closure->upvalueCount = function->upvalueCount;
+    closure->values = NULL;
     return closure;
 }
 
 ObjUpvalue* newUpvalue(Value* slot) {
   ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
   upvalue->location = slot;
-  upvalue->next = NULL;
   upvalue->closed = NIL_VAL;
   return upvalue;
 }
@@ -154,18 +190,160 @@ ObjClass* newClass(ObjString* name) {
     ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     klass->name = name;
     initTable(&klass->methods);
+    klass->version = 0;
+    klass->fieldCount = 0;
 
     return klass;
 }
 
 ObjInstance* newInstance(ObjClass* klass) {
+    // 先分配字段数组，避免分配时触发的GC回收未被引用的实例
+    Value* slots = ALLOCATE(Value, klass->fieldCount);
+
     ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
     instance->klass = klass;
+    instance->shape = vm.rootShape;
+    instance->slots = slots;
+    instance->slotCapacity = klass->fieldCount;
     initTable(&instance->fields);
 
     return instance;
 }
 
+ObjShape* newShape(ObjShape* parent, ObjString* name) {
+    ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->name = name;
+    shape->fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+    initTable(&shape->slots);
+    initTable(&shape->transitions);
+
+    if (parent != NULL) {
+        push(OBJ_VAL(shape));
+        tableAddAll(&parent->slots, &shape->slots);
+        tableSet(&shape->slots, name, NUMBER_VAL(shape->fieldCount - 1));
+        writeBarrierTable((Obj*)shape, &shape->slots);
+        pop();
+    }
+
+    return shape;
+}
+
+/**
+ * @return slot of field name in shape, or -1 if shape doesn't have the field
+ */
+int shapeSlot(ObjShape* shape, ObjString* name) {
+    Value slot;
+    if (!tableGet(&shape->slots, name, &slot)) {
+        return -1;
+    }
+    return (int)AS_NUMBER(slot);
+}
+
+/**
+ * find or create the child shape of shape that appends field name
+ */
+ObjShape* shapeTransition(ObjShape* shape, ObjString* name) {
+    Value next;
+    if (tableGet(&shape->transitions, name, &next)) {
+        return AS_SHAPE(next);
+    }
+
+    ObjShape* child = newShape(shape, name);
+    push(OBJ_VAL(child));
+    tableSet(&shape->transitions, name, OBJ_VAL(child));
+    writeBarrier((Obj*)shape, OBJ_VAL(name));
+    writeBarrier((Obj*)shape, OBJ_VAL(child));
+    pop();
+
+    return child;
+}
+
+void ensureSlotCapacity(ObjInstance* instance, int count) {
+    if (instance->slotCapacity >= count) {
+        return;
+    }
+
+    int oldCapacity = instance->slotCapacity;
+    int capacity = oldCapacity < 4 ? 4 : oldCapacity * 2;
+    if (capacity < count) {
+        capacity = count;
+    }
+    GROW_SHARED_ARRAY(Value, instance->slots, oldCapacity, capacity);
+    instance->slotCapacity = capacity;
+}
+
+// 字段过多时放弃共享shape，之后的读写都通过实例自己的哈希表完成
+static void toDictionaryMode(ObjInstance* instance) {
+    ObjShape* shape = instance->shape;
+    for (ObjShape* field = shape; field->name != NULL; field = field->parent) {
+        tableSet(&instance->fields, field->name, instance->slots[field->fieldCount - 1]);
+    }
+
+    writeBarrierTable((Obj*)instance, &instance->fields);
+
+#ifdef CONCURRENT_MARK
+    // 标记线程根据shape读取slots
+    lockHeap();
+#endif
+    FREE_ARRAY(Value, instance->slots, instance->slotCapacity);
+    instance->slots = NULL;
+    instance->slotCapacity = 0;
+    instance->shape = NULL;
+#ifdef CONCURRENT_MARK
+    unlockHeap();
+#endif
+}
+
+bool getField(ObjInstance* instance, ObjString* name, Value* value) {
+    if (instance->shape == NULL) {
+        return tableGet(&instance->fields, name, value);
+    }
+
+    int slot = shapeSlot(instance->shape, name);
+    if (slot == -1) {
+        return false;
+    }
+
+    *value = instance->slots[slot];
+    return true;
+}
+
+// may trigger gc, instance and value must be reachable
+void setField(ObjInstance* instance, ObjString* name, Value value) {
+    if (instance->shape != NULL) {
+        int slot = shapeSlot(instance->shape, name);
+        if (slot != -1) {
+            satbBarrier(instance->slots[slot]);
+            instance->slots[slot] = value;
+            writeBarrier((Obj*)instance, value);
+            return;
+        }
+
+        if (instance->shape->fieldCount == SHAPE_MAX_FIELDS) {
+            toDictionaryMode(instance);
+        }
+    }
+
+    if (instance->shape == NULL) {
+        tableSet(&instance->fields, name, value);
+        writeBarrier((Obj*)instance, OBJ_VAL(name));
+        writeBarrier((Obj*)instance, value);
+        return;
+    }
+
+    ObjShape* next = shapeTransition(instance->shape, name);
+    ensureSlotCapacity(instance, next->fieldCount);
+    instance->slots[next->fieldCount - 1] = value;
+    PUBLISH(instance->shape, next);
+    writeBarrier((Obj*)instance, value);
+    writeBarrier((Obj*)instance, OBJ_VAL(next));
+
+    if (instance->klass->fieldCount < next->fieldCount) {
+        instance->klass->fieldCount = next->fieldCount;
+    }
+}
+
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
     ObjBoundMethod* boundMethod = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
     boundMethod->receiver = receiver;
@@ -19,15 +19,20 @@
 #define IS_CLASS(value) isObjType(value, OBJ_CLASS)
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_SHAPE(value) isObjType(value, OBJ_SHAPE)
 
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
 #define AS_CLOSURE(value) ((ObjClosure*)AS_OBJ(value))
-#define AS_NATIVE(value) (((ObjNative*)AS_OBJ(value))->function)
+#define AS_NATIVE(value) ((ObjNative*)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
 #define AS_CLASS(value) ((ObjClass*)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
+#define AS_SHAPE(value) ((ObjShape*)AS_OBJ(value))
+
+// 实例字段数超过这个值后切换为字典模式，使用独立的哈希表保存字段
+#define SHAPE_MAX_FIELDS 64
 
 typedef enum {
     OBJ_STRING,
@@ -38,12 +43,17 @@ typedef enum {
     OBJ_CLASS,
     OBJ_INSTANCE,
     OBJ_BOUND_METHOD,
+    OBJ_SHAPE,
 } ObjType;
 
 struct Obj {
     ObjType type;
-    bool isMarked;
-    struct Obj* next;
+#ifdef GENERATIONAL_GC
+    // 老年代对象已经在vm.remembered中
+    bool isRemembered;
+    // 新生代对象晋升后指向老年代中的副本，老年代对象不使用
+    struct Obj* forward;
+#endif
 };
 
 // TODO: 去掉ObjString编译出错 typedef struct {
@@ -59,40 +69,94 @@ typedef struct {
     int arity;
     Chunk chunk;
     int upvalueCount;
+    // 栈帧最多占用的栈槽数，包括局部变量和表达式的临时值，由编译器按每条指令的栈效果算出，
+    // 调用时在此之外再保留FRAME_STACK_SLACK个栈槽
+    int maxSlots;
     ObjString* name;
+#ifdef CLOX_JIT
+    // 调用和循环回跳计数，达到JIT_THRESHOLD后编译为机器码
+    int hotness;
+    struct JitCode* jit;
+#endif
 } ObjFunction;
 
 typedef struct ObjUpvalue {
   Obj obj;
   Value* location;
-  struct ObjUpvalue* next;
   Value closed;
 } ObjUpvalue;
 
-typedef struct {
+typedef struct ObjClosure {
     Obj obj;
     ObjFunction* function;
     ObjUpvalue** upvalues;
     int upvalueCount;
+    // 按值捕获的变量保存在这里，不是堆上的对象，也不在vm.openUpvalues中，
+    // 有按值捕获时才分配，大小为upvalueCount
+    ObjUpvalue* values;
 } ObjClosure;
 
-typedef struct {
+// upvalue captured by value, it's part of closure->values instead of a heap object
+#define IS_VALUE_UPVALUE(closure, upvalue) \
+    ((closure)->values != NULL && (upvalue) >= (closure)->values && \
+     (upvalue) < (closure)->values + (closure)->upvalueCount)
+
+typedef struct ObjClass {
     Obj obj;
     ObjString* name;
     Table methods;
+    // 方法表每次修改后加1，使内联缓存失效
+    int version;
+    // 实例最多使用过的字段数，新建实例时按这个数量预分配字段数组
+    int fieldCount;
 } ObjClass;
 
+// hidden class, instances that add the same fields in the same order share
+// one shape, the shape maps field names to slots of the instance's field array
+typedef struct ObjShape {
+    Obj obj;
+    struct ObjShape* parent;
+    // field added by the transition from parent, NULL for the root shape
+    ObjString* name;
+    int fieldCount;
+    // field name -> slot number
+    Table slots;
+    // field name -> child shape with that field appended
+    Table transitions;
+} ObjShape;
+
 typedef struct {
     Obj obj;
     ObjClass* klass;
+    // NULL in dictionary mode, where fields are kept in the fields table
+    ObjShape* shape;
+    Value* slots;
+    int slotCapacity;
     Table fields;
 } ObjInstance;
 
-typedef Value (*NativeFn)(int argCount, Value* args);
+/**
+ * args[-1] is the slot of the callee, a native writes its result there
+ * @return false after reporting a runtime error
+ */
+typedef bool (*NativeFn)(int argCount, Value* args);
+
+// fast path of natives taking only numbers, called when every argument is a number
+typedef double (*NumberNativeFn)(const double* args);
+
+// 数字快速路径最多接受的参数个数
+#define NATIVE_NUMBER_ARGS_MAX 4
+
+// 可变参数的原生函数
+#define NATIVE_ANY_ARITY (-1)
 
 typedef struct {
     Obj obj;
+    // 可以为NULL，只有数字快速路径时其他类型的参数报告运行时错误
     NativeFn function;
+    NumberNativeFn numberFunction;
+    int arity;
+    ObjString* name;
 } ObjNative;
 
 typedef struct {
@@ -109,7 +173,7 @@ ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
 
 ObjFunction* newFunction();
 
-ObjNative* newNative(NativeFn function);
+ObjNative* newNative(ObjString* name, int arity, NativeFn function, NumberNativeFn numberFunction);
 
 ObjString* takeString(const char* chars, int length);
 
@@ -125,4 +189,16 @@ ObjClass* newClass(ObjString* name);
 
 ObjInstance* newInstance(ObjClass* klass);
 
+ObjShape* newShape(ObjShape* parent, ObjString* name);
+
+int shapeSlot(ObjShape* shape, ObjString* name);
+
+ObjShape* shapeTransition(ObjShape* shape, ObjString* name);
+
+void ensureSlotCapacity(ObjInstance* instance, int count);
+
+bool getField(ObjInstance* instance, ObjString* name, Value* value);
+
+void setField(ObjInstance* instance, ObjString* name, Value value);
+
 #endif //CLOX1_OBJECT_H
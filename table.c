@@ -87,10 +87,17 @@ static void adjustCapacity(Table* table, int capacity) {
         table->count++;
     }
 
+#ifdef CONCURRENT_MARK
+    // 标记线程读取的entries和capacity必须一致
+    lockHeap();
+#endif
     FREE_ARRAY(Entry, table->entries, table->capacity);
 
     table->entries = entries;
     table->capacity = capacity;
+#ifdef CONCURRENT_MARK
+    unlockHeap();
+#endif
 }
 
 bool tableSet(Table* table, ObjString* key, Value value) {
@@ -106,6 +113,7 @@ bool tableSet(Table* table, ObjString* key, Value value) {
         table->count++;
     }
 
+    satbBarrier(entry->value);
     entry->key = key;
     entry->value = value;
 
@@ -152,9 +160,9 @@ void markTable(Table* table) {
 }
 
 void tableRemoveWhile(Table* table) {
-    for (int i = 0; i < table->count; i++) {
+    for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
+        if (entry->key != NULL && !isMarked((Obj*)entry->key)) {
             tableDelete(table, entry->key);
         }
     }
@@ -15,11 +15,11 @@ void writeValueArray(ValueArray* array, Value value) {
 	if (array->capacity < array->count + 1) {
 		int oldCapacity = array->capacity;
 		array->capacity = GROW_CAPACITY(oldCapacity);
-		array->values= GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+		GROW_SHARED_ARRAY(Value, array->values, oldCapacity, array->capacity);
 	}
 
 	array->values[array->count] = value;
-	array->count++;
+	PUBLISH(array->count, array->count + 1);
 }
 
 void freeValueArray(ValueArray* array) {
@@ -28,6 +28,19 @@ void freeValueArray(ValueArray* array) {
 }
 
 void printValue(Value value) {
+#ifdef NAN_BOXING
+    if (IS_BOOL(value)) {
+        printf(AS_BOOL(value) ? "true" : "false");
+    } else if (IS_NIL(value)) {
+        printf("nil");
+    } else if (IS_NUMBER(value)) {
+        printf("%g", AS_NUMBER(value));
+    } else if (IS_OBJ(value)) {
+        printObject(value);
+    } else if (IS_UNDEFINED(value)) {
+        printf("undefined");
+    }
+#else
     switch (value.type) {
         case VAL_NIL:
             printf("nil");break;
@@ -40,19 +53,31 @@ void printValue(Value value) {
         case VAL_OBJ:
             printObject(value);
             break;
+        case VAL_UNDEFINED:
+            printf("undefined");
+            break;
     }
+#endif
 }
 
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+    // NaN != NaN，数字仍然按double比较，其他类型的位模式唯一
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    return a == b;
+#else
     if (a.type != b.type) return false;
     switch (a.type) {
         case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL:    return true;
+        case VAL_UNDEFINED: return true;
         case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
         case VAL_OBJ:
             // 使用interned ObjString对象，直接比较指针即可
             return AS_OBJ(a) == AS_OBJ(b);
         default:         return false; // Unreachable.
     }
+#endif
 }
-
@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stdarg.h>
 #include <string.h>
 #include <stdio.h>
@@ -11,14 +12,35 @@
 #include "chunk.h"
 #include "memory.h"
 #include "object.h"
+#include "jit.h"
 
 VM vm;
 
-static void defineNative(const char* name, NativeFn function) {
+/**
+ * find the slot of global variable name, a new slot starts out undefined
+ * so code compiled before the definition reports it at runtime
+ */
+int globalSlot(ObjString* name) {
+    Value slot;
+    if (tableGet(&vm.globals, name, &slot)) {
+        return (int)AS_NUMBER(slot);
+    }
+
+    push(OBJ_VAL(name));
+    writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+    writeValueArray(&vm.globalNames, OBJ_VAL(name));
+    tableSet(&vm.globals, name, NUMBER_VAL(vm.globalValues.count - 1));
+    pop();
+
+    return vm.globalValues.count - 1;
+}
+
+static void defineNative(const char* name, int arity, NativeFn function, NumberNativeFn numberFunction) {
     // for gc to track those objects push onto and then pop off stack
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
-    push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    push(OBJ_VAL(newNative(AS_STRING(vm.stack[0]), arity, function, numberFunction)));
+    int slot = globalSlot(AS_STRING(vm.stack[0]));
+    vm.globalValues.values[slot] = vm.stack[1];
 
     pop();
     pop();
@@ -27,17 +49,49 @@ static void defineNative(const char* name, NativeFn function) {
 void resetStack() {
 	vm.stackTop = vm.stack;
     vm.frameCount = 0;
-    vm.openValues = NULL;
+    memset(vm.openUpvalues, 0, sizeof(ObjUpvalue*) * vm.openTop);
+    vm.openTop = 0;
 }
 
-static Value clockNative(int argCount, Value* args) {
-    return NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
+static double clockNative(const double* args) {
+    return (double) clock() / CLOCKS_PER_SEC;
 }
 
+static double sqrtNative(const double* args) {
+    return sqrt(args[0]);
+}
+
+static double floorNative(const double* args) {
+    return floor(args[0]);
+}
+
+static double absNative(const double* args) {
+    return fabs(args[0]);
+}
+
+#ifdef COMPACT_GC
+// 对象只能在安全点移动，这里只发出请求，返回后由解释器整理
+static bool compactHeapNative(int argCount, Value* args) {
+    vm.compactRequested = true;
+    args[-1] = NIL_VAL;
+    return true;
+}
+#endif
+
 
 void initVM() {
+    vm.frameCapacity = FRAMES_INITIAL;
+    vm.frameLimit = FRAME_LIMIT;
+    vm.frames = malloc(sizeof(CallFrame) * vm.frameCapacity);
+    vm.stackCapacity = STACK_INITIAL;
+    vm.stack = malloc(sizeof(Value) * vm.stackCapacity);
+    vm.openUpvalues = calloc(vm.stackCapacity, sizeof(ObjUpvalue*));
+    vm.openTop = 0;
+    if (vm.frames == NULL || vm.stack == NULL || vm.openUpvalues == NULL) {
+        exit(1);
+    }
 	resetStack();
-    vm.objects = NULL;
+    memset(vm.sizeClasses, 0, sizeof(vm.sizeClasses));
 
     vm.bytesAllocated = 0;
     vm.nextGC = 1024 * 1024;
@@ -46,27 +100,111 @@ void initVM() {
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
 
+    vm.gcPhase = GC_IDLE;
+    vm.gcSliceBudget = GC_SLICE_BUDGET;
+#ifdef PARALLEL_MARK
+    vm.gcMarkThreads = GC_MARK_THREADS;
+#endif
+#ifdef COMPACT_GC
+    vm.compactThreshold = COMPACT_THRESHOLD;
+    vm.compactRequested = false;
+#endif
+
+#ifdef GENERATIONAL_GC
+    vm.nursery = malloc(NURSERY_SIZE);
+    if (vm.nursery == NULL) {
+        exit(1);
+    }
+    vm.nurseryMarks = calloc(NURSERY_MARK_WORDS, sizeof(uint64_t));
+    if (vm.nurseryMarks == NULL) {
+        exit(1);
+    }
+    vm.nurseryTop = vm.nursery;
+    vm.nurseryFull = false;
+    vm.remembered = NULL;
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
+#endif
+
     initTable(&vm.strings);
     // 先初始化为NULL，防止copyString触发GC时会访问到initString
     vm.initString = NULL;
     vm.initString = copyString("init", 4);
 
+    vm.rootShape = NULL;
+    vm.rootShape = newShape(NULL, NULL);
+
     initTable(&vm.globals);
+    initValueArray(&vm.globalValues);
+    initValueArray(&vm.globalNames);
+
+    defineNative("clock", 0, NULL, clockNative);
+    defineNative("sqrt", 1, NULL, sqrtNative);
+    defineNative("floor", 1, NULL, floorNative);
+    defineNative("abs", 1, NULL, absNative);
+#ifdef COMPACT_GC
+    defineNative("compactHeap", 0, compactHeapNative, NULL);
+#endif
+}
 
-    defineNative("clock", clockNative);
+#ifdef DEBUG_PROFILE_CALLS
+static uint64_t callCacheHits;
+static uint64_t callCacheMisses;
+
+static void printCallCacheProfile() {
+    uint64_t total = callCacheHits + callCacheMisses;
+    printf("== call cache ==\n");
+    printf("%llu calls, %llu hits, %llu misses, hit rate %.2f%%\n",
+           (unsigned long long)total, (unsigned long long)callCacheHits,
+           (unsigned long long)callCacheMisses,
+           total == 0 ? 0.0 : 100.0 * (double)callCacheHits / (double)total);
 }
+#endif
 
 void freeVM() {
+#ifdef DEBUG_PROFILE_OPCODES
+    printOpcodeProfile();
+#endif
+#ifdef DEBUG_PROFILE_CALLS
+    printCallCacheProfile();
+#endif
+#ifdef DEBUG_PROFILE_GC
+    printGcProfile();
+#endif
+
     freeObjects();
+#ifdef GENERATIONAL_GC
+    free(vm.nursery);
+    vm.nursery = NULL;
+    free(vm.nurseryMarks);
+    vm.nurseryMarks = NULL;
+#endif
 
     vm.initString = NULL;
+    vm.rootShape = NULL;
 
     freeTable(&vm.strings);
     freeTable(&vm.globals);
+    freeValueArray(&vm.globalValues);
+    freeValueArray(&vm.globalNames);
+
+    free(vm.frames);
+    free(vm.stack);
+    free(vm.openUpvalues);
+    vm.frames = NULL;
+    vm.stack = NULL;
+    vm.openUpvalues = NULL;
 }
 
+// 调用栈很深时只打印两端的栈帧
+#define STACK_TRACE_EDGE 16
+
 static void printStackTrace() {
     for (int i = vm.frameCount - 1; i >= 0; i--) {
+        if (i == vm.frameCount - 1 - STACK_TRACE_EDGE && i >= STACK_TRACE_EDGE) {
+            fprintf(stderr, "... %d more frames\n", i - STACK_TRACE_EDGE + 1);
+            i = STACK_TRACE_EDGE - 1;
+        }
         CallFrame *frame = &vm.frames[i];
         ObjFunction* function = frame->closure->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
@@ -94,23 +232,84 @@ static void runtimeError(const char* format, ...) {
     resetStack();
 }
 
+static void growFrames() {
+    int capacity = vm.frameCapacity * 2;
+    if (capacity > vm.frameLimit) {
+        capacity = vm.frameLimit;
+    }
+    CallFrame* frames = realloc(vm.frames, sizeof(CallFrame) * capacity);
+    if (frames == NULL) {
+        exit(1);
+    }
+    vm.frames = frames;
+    vm.frameCapacity = capacity;
+}
+
+/**
+ * make room for count values on the stack, moving the stack relocates
+ * slots of every frame, stack top and locations of open upvalues
+ */
+static void ensureStack(int count) {
+    if (count <= vm.stackCapacity) return;
+
+    int capacity = vm.stackCapacity * 2;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    Value* stack = malloc(sizeof(Value) * capacity);
+    ObjUpvalue** openUpvalues = realloc(vm.openUpvalues, sizeof(ObjUpvalue*) * capacity);
+    if (stack == NULL || openUpvalues == NULL) {
+        exit(1);
+    }
+    memcpy(stack, vm.stack, sizeof(Value) * (vm.stackTop - vm.stack));
+    memset(openUpvalues + vm.stackCapacity, 0, sizeof(ObjUpvalue*) * (capacity - vm.stackCapacity));
+    vm.openUpvalues = openUpvalues;
+
+    for (int i = 0; i < vm.frameCount; i++) {
+        vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+    }
+    for (int i = 0; i < vm.openTop; i++) {
+        if (vm.openUpvalues[i] != NULL) {
+            vm.openUpvalues[i]->location = stack + i;
+        }
+    }
+    vm.stackTop = stack + (vm.stackTop - vm.stack);
+
+    free(vm.stack);
+    vm.stack = stack;
+    vm.stackCapacity = capacity;
+}
+
+// push new frame on top of call stack, room for the frame and its stack slots is already checked
+static inline void pushFrame(ObjClosure* closure, Value* slots) {
+    CallFrame* frame = &vm.frames[vm.frameCount++];
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code;
+    frame->slots = slots;
+
+#ifdef CLOX_JIT
+    JIT_COUNT(closure->function);
+#endif
+}
+
 static bool call(ObjClosure* closure, int argCount) {
     if (argCount != closure->function->arity) {
         runtimeError("Expected %d arguments but got %d", closure->function->arity, argCount);
         return false;
     }
 
-    if (vm.frameCount == FRAME_MAX) {
+    if (vm.frameCount == vm.frameLimit) {
         runtimeError("Stackoverflow");
         return false;
     }
 
-    // push new frame on top of call stack
-    CallFrame* frame = &vm.frames[vm.frameCount++];
-    frame->closure = closure;
-    frame->ip = closure->function->chunk.code;
-    frame->slots = vm.stackTop - argCount - 1;
+    if (vm.frameCount == vm.frameCapacity) {
+        growFrames();
+    }
+    // 栈移动后run()在调用返回后重新读取frame、slots和stackTop
+    ensureStack((int)(vm.stackTop - argCount - 1 - vm.stack) + closure->function->maxSlots + FRAME_STACK_SLACK);
 
+    pushFrame(closure, vm.stackTop - argCount - 1);
     return true;
 }
 
@@ -151,6 +350,39 @@ static Value peek(int offset) {
     return vm.stackTop[- 1 - offset];
 }
 
+static bool callNative(ObjNative* native, int argCount) {
+    if (native->arity != NATIVE_ANY_ARITY && argCount != native->arity) {
+        runtimeError("Expected %d arguments but got %d", native->arity, argCount);
+        return false;
+    }
+
+    Value* args = vm.stackTop - argCount;
+    if (native->numberFunction != NULL) {
+        double numbers[NATIVE_NUMBER_ARGS_MAX];
+        int i = 0;
+        while (i < argCount && IS_NUMBER(args[i])) {
+            numbers[i] = AS_NUMBER(args[i]);
+            i++;
+        }
+        if (i == argCount) {
+            args[-1] = NUMBER_VAL(native->numberFunction(numbers));
+            vm.stackTop = args;
+            return true;
+        }
+        if (native->function == NULL) {
+            runtimeError("Arguments of %s must be numbers.", native->name->chars);
+            return false;
+        }
+    }
+
+    // 结果直接写入被调用者的栈槽，之后丢弃参数
+    if (!native->function(argCount, args)) {
+        return false;
+    }
+    vm.stackTop = args;
+    return true;
+}
+
 static bool callValue(Value callee, int argCount) {
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee))
@@ -163,13 +395,8 @@ static bool callValue(Value callee, int argCount) {
         }
 
         // 不新增栈帧，需要手工回退栈顶位置
-        case OBJ_NATIVE: {
-            NativeFn native = AS_NATIVE(callee);
-            Value result = native(argCount, vm.stackTop - argCount);
-            vm.stackTop -= argCount + 1;
-            push(result);
-            return true;
-        }
+        case OBJ_NATIVE:
+            return callNative(AS_NATIVE(callee), argCount);
 
         case OBJ_CLASS: {
             ObjClass* klass = AS_CLASS(callee);
@@ -202,6 +429,78 @@ static bool callValue(Value callee, int argCount) {
     return false;
 }
 
+/**
+ * call callee through the call-site cache, only room for a new frame is checked
+ * since frameCount < frameCapacity <= frameLimit
+ * @return false when the cache misses or frames and stack have to grow, callValue handles the call then
+ */
+static inline bool callCached(CallCache* cache, Value callee, int argCount) {
+    if (!IS_OBJ(callee) || AS_OBJ(callee) != cache->callee) {
+        return false;
+    }
+    if (cache->kind == CALL_CLASS && ((ObjClass*)cache->callee)->version != cache->version) {
+        return false;
+    }
+
+    ObjClosure* closure = cache->closure;
+    Value* slots = vm.stackTop - argCount - 1;
+    if (closure != NULL && (vm.frameCount == vm.frameCapacity ||
+        (int)(slots - vm.stack) + closure->function->maxSlots + FRAME_STACK_SLACK > vm.stackCapacity)) {
+        return false;
+    }
+
+    switch (cache->kind) {
+        case CALL_CLOSURE:
+            break;
+        case CALL_BOUND_METHOD:
+            *slots = ((ObjBoundMethod*)cache->callee)->receiver;
+            break;
+        case CALL_CLASS:
+            *slots = OBJ_VAL(newInstance((ObjClass*)cache->callee));
+            break;
+    }
+
+    if (closure != NULL) {
+        pushFrame(closure, slots);
+    }
+    return true;
+}
+
+// remember callee after callValue called it successfully, natives are not cached
+static void updateCallCache(ObjFunction* function, CallCache* cache, Value callee) {
+    if (!IS_OBJ(callee)) return;
+
+    satbBarrierObject(cache->callee);
+    satbBarrierObject((Obj*)cache->closure);
+
+    switch (OBJ_TYPE(callee)) {
+        case OBJ_CLOSURE:
+            cache->kind = CALL_CLOSURE;
+            cache->closure = AS_CLOSURE(callee);
+            break;
+        case OBJ_BOUND_METHOD:
+            cache->kind = CALL_BOUND_METHOD;
+            cache->closure = AS_BOUND_METHOD(callee)->method;
+            break;
+        case OBJ_CLASS: {
+            ObjClass* klass = AS_CLASS(callee);
+            Value initializer;
+            cache->kind = CALL_CLASS;
+            cache->closure = tableGet(&klass->methods, vm.initString, &initializer)
+                ? AS_CLOSURE(initializer) : NULL;
+            cache->version = klass->version;
+            break;
+        }
+        default:
+            return;
+    }
+    cache->callee = AS_OBJ(callee);
+    writeBarrier((Obj*)function, callee);
+    if (cache->closure != NULL) {
+        writeBarrier((Obj*)function, OBJ_VAL(cache->closure));
+    }
+}
+
 static bool bindMethod(ObjClass* klass, ObjString* name) {
     Value method;
     if (! tableGet(&klass->methods, name, &method)) {
@@ -216,27 +515,17 @@ static bool bindMethod(ObjClass* klass, ObjString* name) {
     return true;
 }
 
-// TODO: 向有序链表中插入新元素，或者如果存在相同元素，返回已有元素
+// 同一个栈槽只有一个打开的upvalue，按栈槽下标直接查找
 static ObjUpvalue* captureUpvalue(Value* local) {
-    ObjUpvalue* preUpvalue = NULL;
-    ObjUpvalue* upvalue = vm.openValues;
-
-    while (upvalue != NULL && upvalue->location > local) {
-        preUpvalue = upvalue;
-        upvalue = upvalue->next;
-    }
-
-    if (upvalue != NULL && upvalue->location == local) {
-        return upvalue;
+    int slot = (int)(local - vm.stack);
+    if (vm.openUpvalues[slot] != NULL) {
+        return vm.openUpvalues[slot];
     }
 
     ObjUpvalue* createdUpvalue = newUpvalue(local);
-    createdUpvalue->next = upvalue;
-
-    if (preUpvalue == NULL) {
-        vm.openValues = createdUpvalue;
-    } else {
-        preUpvalue->next = createdUpvalue;
+    vm.openUpvalues[slot] = createdUpvalue;
+    if (slot >= vm.openTop) {
+        vm.openTop = slot + 1;
     }
 
     return createdUpvalue;
@@ -246,21 +535,70 @@ static ObjUpvalue* captureUpvalue(Value* local) {
 // 1. 块级作用域结束，块内变量close
 // 2. 函数执行完成，函数参数此时在栈顶，也需要close
 static void closeUpvalues(Value* last) {
-    while (vm.openValues != NULL && vm.openValues->location >= last)  {
-        ObjUpvalue* upvalue = vm.openValues;
+    int slot = (int)(last - vm.stack);
+    for (int i = vm.openTop - 1; i >= slot; i--) {
+        ObjUpvalue* upvalue = vm.openUpvalues[i];
+        if (upvalue == NULL) continue;
 
         // 从栈上拷贝到Upvalue closed字段，堆上
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        writeBarrier((Obj*)upvalue, upvalue->closed);
+        vm.openUpvalues[i] = NULL;
+    }
 
-        vm.openValues = upvalue->next;
+    if (vm.openTop > slot) {
+        vm.openTop = slot;
     }
 }
 
+/**
+ * set upvalue i of closure being created by frame from one OP_CLOSURE operand,
+ * values are copied into closure->values without allocating an ObjUpvalue
+ */
+static void captureOperand(ObjClosure* closure, int i, uint8_t capture, uint32_t index, CallFrame* frame) {
+    // 捕获时可能分配对象，增量标记可能已经标记了新的闭包
+    if (capture == CAPTURE_LOCAL) {
+        closure->upvalues[i] = captureUpvalue(frame->slots + index);
+        writeBarrier((Obj*)closure, OBJ_VAL(closure->upvalues[i]));
+        return;
+    }
+
+    Value value;
+    if (capture == CAPTURE_LOCAL_VALUE) {
+        value = frame->slots[index];
+    } else {
+        ObjUpvalue* upvalue = frame->closure->upvalues[index];
+        // 外层闭包按值捕获的变量同样按值复制，不能引用其他闭包的values
+        if (!IS_VALUE_UPVALUE(frame->closure, upvalue)) {
+            closure->upvalues[i] = upvalue;
+            writeBarrier((Obj*)closure, OBJ_VAL(upvalue));
+            return;
+        }
+        value = upvalue->closed;
+    }
+
+    if (closure->values == NULL) {
+        PUBLISH(closure->values, ALLOCATE(ObjUpvalue, closure->upvalueCount));
+    }
+    ObjUpvalue* upvalue = &closure->values[i];
+    upvalue->obj.type = OBJ_UPVALUE;
+#ifdef GENERATIONAL_GC
+    upvalue->obj.forward = NULL;
+#endif
+    upvalue->closed = value;
+    upvalue->location = &upvalue->closed;
+    PUBLISH(closure->upvalues[i], upvalue);
+    writeBarrier((Obj*)closure, value);
+}
+
 static void defineMethod(ObjString* name) {
     Value method = peek(0);
     ObjClass* klass = AS_CLASS(peek(1));
     tableSet(&klass->methods, name, method);
+    writeBarrier((Obj*)klass, OBJ_VAL(name));
+    writeBarrier((Obj*)klass, method);
+    klass->version++;
 
     // pop off method on stack top
     pop();
@@ -286,6 +624,152 @@ static void concatenate() {
     push(OBJ_VAL(result));
 }
 
+// inline caches belong to the function of the frame on top, which runs the instruction
+static void cacheBarrier(Obj* object) {
+    writeBarrier((Obj*)vm.frames[vm.frameCount - 1].closure->function, OBJ_VAL(object));
+}
+
+// 缓存项被覆盖前，其中的对象可能只有这里引用
+static void shadeCacheEntry(InlineCacheEntry* entry) {
+    satbBarrierObject((Obj*)entry->klass);
+    satbBarrierObject((Obj*)entry->shape);
+    satbBarrierObject((Obj*)entry->transition);
+    satbBarrierObject((Obj*)entry->method);
+}
+
+static InlineCacheEntry* findCacheEntry(InlineCache* cache, ObjClass* klass) {
+    for (int i = 0; i < INLINE_CACHE_SIZE; i++) {
+        InlineCacheEntry* entry = &cache->entries[i];
+        if (entry->klass == klass && entry->version == klass->version) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// 缓存未命中时为klass分配一项，已有的过期项直接复用，写满后轮流替换
+static InlineCacheEntry* addCacheEntry(InlineCache* cache, ObjClass* klass) {
+    InlineCacheEntry* entry = NULL;
+    for (int i = 0; i < INLINE_CACHE_SIZE; i++) {
+        if (cache->entries[i].klass == klass || cache->entries[i].klass == NULL) {
+            entry = &cache->entries[i];
+            break;
+        }
+    }
+
+    if (entry == NULL) {
+        entry = &cache->entries[cache->next];
+        cache->next = (cache->next + 1) % INLINE_CACHE_SIZE;
+    }
+
+    shadeCacheEntry(entry);
+    entry->klass = klass;
+    cacheBarrier((Obj*)klass);
+    entry->version = klass->version;
+    entry->shape = NULL;
+    entry->fieldIndex = -1;
+    entry->transition = NULL;
+    entry->method = NULL;
+    return entry;
+}
+
+static bool getCachedField(InlineCache* cache, ObjInstance* instance, ObjString* name, Value* value) {
+    ObjShape* shape = instance->shape;
+    InlineCacheEntry* entry = findCacheEntry(cache, instance->klass);
+    // 相同shape的实例字段位置相同，不需要再查找
+    if (entry != NULL && shape != NULL && entry->shape == shape) {
+        if (entry->fieldIndex == -1) {
+            return false;
+        }
+        *value = instance->slots[entry->fieldIndex];
+        return true;
+    }
+
+    if (shape == NULL) {
+        return tableGet(&instance->fields, name, value);
+    }
+
+    if (entry == NULL) {
+        entry = addCacheEntry(cache, instance->klass);
+    }
+    shadeCacheEntry(entry);
+    entry->shape = shape;
+    cacheBarrier((Obj*)shape);
+    entry->fieldIndex = shapeSlot(shape, name);
+    entry->transition = NULL;
+
+    if (entry->fieldIndex == -1) {
+        return false;
+    }
+    *value = instance->slots[entry->fieldIndex];
+    return true;
+}
+
+// may trigger gc when adding a new field, instance and value must be reachable
+static void setCachedField(InlineCache* cache, ObjInstance* instance, ObjString* name, Value value) {
+    ObjShape* shape = instance->shape;
+    InlineCacheEntry* entry = findCacheEntry(cache, instance->klass);
+    if (entry != NULL && shape != NULL && entry->shape == shape) {
+        if (entry->fieldIndex != -1) {
+            satbBarrier(instance->slots[entry->fieldIndex]);
+            instance->slots[entry->fieldIndex] = value;
+            writeBarrier((Obj*)instance, value);
+            return;
+        }
+
+        // 新增字段，直接转换到缓存的shape
+        if (entry->transition != NULL) {
+            ObjShape* next = entry->transition;
+            ensureSlotCapacity(instance, next->fieldCount);
+            instance->slots[next->fieldCount - 1] = value;
+            PUBLISH(instance->shape, next);
+            writeBarrier((Obj*)instance, value);
+            writeBarrier((Obj*)instance, OBJ_VAL(next));
+            return;
+        }
+    }
+
+    setField(instance, name, value);
+
+    if (shape == NULL) {
+        return;
+    }
+
+    if (entry == NULL) {
+        entry = addCacheEntry(cache, instance->klass);
+    }
+    shadeCacheEntry(entry);
+    entry->shape = shape;
+    cacheBarrier((Obj*)shape);
+    if (instance->shape != shape && instance->shape != NULL) {
+        entry->fieldIndex = -1;
+        entry->transition = instance->shape;
+        cacheBarrier((Obj*)instance->shape);
+    } else {
+        entry->fieldIndex = shapeSlot(shape, name);
+        entry->transition = NULL;
+    }
+}
+
+static ObjClosure* findCachedMethod(InlineCache* cache, ObjClass* klass, ObjString* name) {
+    InlineCacheEntry* entry = findCacheEntry(cache, klass);
+    if (entry != NULL && entry->method != NULL) {
+        return entry->method;
+    }
+
+    Value method;
+    if (!tableGet(&klass->methods, name, &method)) {
+        return NULL;
+    }
+
+    if (entry == NULL) {
+        entry = addCacheEntry(cache, klass);
+    }
+    entry->method = AS_CLOSURE(method);
+    cacheBarrier((Obj*)entry->method);
+    return entry->method;
+}
+
 static bool invokeFromClass(ObjClass* klass, ObjString* name, uint8_t argCount) {
     Value method;
     if (!tableGet(&klass->methods, name, &method)) {
@@ -296,7 +780,7 @@ static bool invokeFromClass(ObjClass* klass, ObjString* name, uint8_t argCount)
     return call(AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(ObjString* name, int argCount) {
+static bool invoke(ObjString* name, int argCount, InlineCache* cache) {
     Value receiver = peek(argCount);
 
   if (!IS_INSTANCE(receiver)) {
@@ -309,312 +793,862 @@ static bool invoke(ObjString* name, int argCount) {
 
 // 先检查属性，可能动态添加方法
   Value value;
-  if (tableGet(&instance->fields, name, &value)) {
+  if (getCachedField(cache, instance, name, &value)) {
     vm.stackTop[-argCount - 1] = value;
     return callValue(value, argCount);
   }
 
-    return invokeFromClass(instance->klass, name, argCount);
+    ObjClosure* method = findCachedMethod(cache, instance->klass, name);
+    if (method == NULL) {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return false;
+    }
+
+    return call(method, argCount);
+}
+
+#ifdef CLOX_JIT
+// 机器码中属性访问的快速路径，只处理实例字段，方法和运行时错误返回false交给解释器
+
+bool jitGetProperty(CallFrame* frame, Value* stackTop, int offset) {
+    if (!IS_INSTANCE(stackTop[-1])) return false;
+
+    Chunk* chunk = &frame->closure->function->chunk;
+    uint8_t* ip = chunk->code + offset;
+    ObjString* name = AS_STRING(chunk->constants.values[ip[1]]);
+    InlineCache* cache = &chunk->caches[(uint16_t)((ip[2] << 8) | ip[3])];
+
+    return getCachedField(cache, AS_INSTANCE(stackTop[-1]), name, &stackTop[-1]);
 }
 
+bool jitSetProperty(CallFrame* frame, Value* stackTop, int offset) {
+    if (!IS_INSTANCE(stackTop[-2])) return false;
+
+    Chunk* chunk = &frame->closure->function->chunk;
+    uint8_t* ip = chunk->code + offset;
+    ObjString* name = AS_STRING(chunk->constants.values[ip[1]]);
+    InlineCache* cache = &chunk->caches[(uint16_t)((ip[2] << 8) | ip[3])];
+
+    setCachedField(cache, AS_INSTANCE(stackTop[-2]), name, stackTop[-1]);
+    stackTop[-2] = stackTop[-1];
+    return true;
+}
+#endif
+
 static InterpertResult run() {
-    CallFrame *frame = &vm.frames[vm.frameCount - 1];
-#define READ_BYTE() (*frame->ip++)
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+    // 解释器循环中频繁访问的状态保存在局部变量中，方便编译器分配到寄存器，
+    // 只在调用、返回、可能触发GC以及运行时错误的位置与CallFrame/VM同步
+    CallFrame* frame;
+    uint8_t* ip;
+    Value* slots;
+    Value* constants;
+    Value* stackTop = vm.stackTop;
+
+#define LOAD_FRAME() \
+    do { \
+        frame = &vm.frames[vm.frameCount - 1]; \
+        ip = frame->ip; \
+        slots = frame->slots; \
+        constants = frame->closure->function->chunk.constants.values; \
+    } while (false)
+// 写回ip和栈顶，之后可以调用会读取vm.stackTop或者分配对象的函数
+#define STORE_STATE() \
+    do { \
+        frame->ip = ip; \
+        vm.stackTop = stackTop; \
+    } while (false)
+#define LOAD_STACK() (stackTop = vm.stackTop)
+
+#define PUSH(value) (*stackTop++ = (value))
+#define POP() (*--stackTop)
+#define DROP() ((void)--stackTop)
+#define PEEK(distance) (stackTop[-1 - (distance)])
+
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (constants[READ_BYTE()])
 #define READ_STRING() (AS_STRING(READ_CONSTANT()))
-#define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_LONG() (ip += 3, (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+#define READ_STRING_LONG() (AS_STRING(constants[READ_LONG()]))
+#define READ_CACHE() (&frame->closure->function->chunk.caches[READ_SHORT()])
+#define READ_CALL_CACHE() (&frame->closure->function->chunk.callCaches[READ_SHORT()])
+// 根据观察到的操作数类型把当前指令改写为特化版本，
+// 特化指令检查类型不符时恢复为通用指令并重新执行
+#define QUICKEN(op) (ip[-1] = (op))
+#define DEQUICKEN(op) \
+    do { \
+        ip[-1] = (op); \
+        ip--; \
+        DISPATCH(); \
+    } while (false)
+#define RUNTIME_ERROR(...) \
+    do { \
+        STORE_STATE(); \
+        runtimeError(__VA_ARGS__); \
+        return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
 #define BINARY_OP(valueType, op) \
     do {              \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-        runtimeError("Operands must be number.s");         \
-        return INTERPRET_RUNTIME_ERROR;\
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+            RUNTIME_ERROR("Operands must be number.s"); \
         }\
-      double b = AS_NUMBER(pop()); \
-      double a = AS_NUMBER(pop()); \
-      push(valueType(a op b)); \
+      double b = AS_NUMBER(POP()); \
+      double a = AS_NUMBER(POP()); \
+      PUSH(valueType(a op b)); \
     } while (false)
 
+// 寄存器指令的源操作数是局部变量或者常量，结果写入局部变量或者压栈
+#define READ_REGISTER(isConstant) ((isConstant) ? constants[READ_BYTE()] : slots[READ_BYTE()])
+#define REGISTER_BINARY_OP(valueType, op) \
+    do { \
+        uint8_t dst = READ_BYTE(); \
+        uint8_t mode = READ_BYTE(); \
+        Value b = READ_REGISTER(mode & REG_B_CONSTANT); \
+        Value c = READ_REGISTER(mode & REG_C_CONSTANT); \
+        if (!IS_NUMBER(b) || !IS_NUMBER(c)) { \
+            RUNTIME_ERROR("Operands must be number.s"); \
+        } \
+        Value result = valueType(AS_NUMBER(b) op AS_NUMBER(c)); \
+        if (mode & REG_DST_LOCAL) { \
+            slots[dst] = result; \
+        } else { \
+            PUSH(result); \
+        } \
+    } while (false)
+
+// 属性指令的短形式和长形式只有读取名字常量的方式不同
+#define GET_PROPERTY(readName) \
+    do { \
+        if (!IS_INSTANCE(PEEK(0))) { \
+            RUNTIME_ERROR("Only instances have properties."); \
+        } \
+        ObjString* name = readName(); \
+        InlineCache* cache = READ_CACHE(); \
+        ObjInstance* instance = AS_INSTANCE(PEEK(0)); \
+        Value value; \
+        if (getCachedField(cache, instance, name, &value)) { \
+            PEEK(0) = value; \
+            DISPATCH(); \
+        } \
+        ObjClosure* method = findCachedMethod(cache, instance->klass, name); \
+        if (method == NULL) { \
+            RUNTIME_ERROR("Undefined property '%s'.", name->chars); \
+        } \
+        STORE_STATE(); \
+        ObjBoundMethod* bound = newBoundMethod(PEEK(0), method); \
+        PEEK(0) = OBJ_VAL(bound); \
+    } while (false)
+#define SET_PROPERTY(readName) \
+    do { \
+        if (!IS_INSTANCE(PEEK(1))) { \
+            RUNTIME_ERROR("Only instances have fields."); \
+        } \
+        ObjString* name = readName(); \
+        InlineCache* cache = READ_CACHE(); \
+        Value value = PEEK(0); \
+        ObjInstance* instance = AS_INSTANCE(PEEK(1)); \
+        STORE_STATE(); \
+        setCachedField(cache, instance, name, value); \
+        DROP(); \
+        DROP(); \
+        PUSH(value); \
+    } while (false)
 
-    printf("\nrun\n");
-    for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("--         ");
-        for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassembleInstruction(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_INSTRUCTION() \
+    do { \
+        printf("--         "); \
+        for (Value* slot = vm.stack; slot < stackTop; slot++) { \
+            printf("[ "); \
+            printValue(*slot); \
+            printf(" ]"); \
+        } \
+        printf("\n"); \
+        disassembleInstruction(&frame->closure->function->chunk, (int)(ip - frame->closure->function->chunk.code)); \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
 #endif
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_RETURN: {
-                Value result = pop();
-                // 栈帧开始的位置
-                closeUpvalues(frame->slots);
-                vm.frameCount--;
-                if (vm.frameCount == 0) {
-                    pop();
-                    return INTERPRET_OK;
-                }
 
-                vm.stackTop = frame->slots;
-                push(result);
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+#ifdef CLOX_JIT
+// 当前帧的函数已经编译时切换到机器码执行，机器码遇到不支持的指令后返回，
+// 由解释器从frame->ip继续执行
+#define JIT_ENTER() \
+    do { \
+        if (frame->closure->function->jit != NULL) { \
+            STORE_STATE(); \
+            jitExecute(frame); \
+            ip = frame->ip; \
+            LOAD_STACK(); \
+        } \
+    } while (false)
+#else
+#define JIT_ENTER() do { } while (false)
+#endif
+
+#ifdef GENERATIONAL_GC
+// 新生代用完后新对象分配到老年代，在循环回跳和调用时回收新生代，
+// 这里C局部变量中没有对象指针，晋升移动对象后只需要更新根和老年代对象
+#ifdef DEBUG_STRESS_GC
+#define NURSERY_SAFEPOINT() \
+    do { \
+        STORE_STATE(); \
+        collectNursery(); \
+    } while (false)
+#else
+#define NURSERY_SAFEPOINT() \
+    do { \
+        if (vm.nurseryFull) { \
+            STORE_STATE(); \
+            collectNursery(); \
+        } \
+    } while (false)
+#endif
+#else
+#define NURSERY_SAFEPOINT() do { } while (false)
+#endif
+
+#ifdef COMPACT_GC
+// 整理堆同样移动对象，请求后在下一个安全点进行
+#define COMPACT_SAFEPOINT() \
+    do { \
+        if (vm.compactRequested) { \
+            STORE_STATE(); \
+            compactHeap(); \
+        } \
+    } while (false)
+#else
+#define COMPACT_SAFEPOINT() do { } while (false)
+#endif
+
+#define SAFEPOINT() \
+    do { \
+        NURSERY_SAFEPOINT(); \
+        COMPACT_SAFEPOINT(); \
+    } while (false)
+
+#ifdef DEBUG_PROFILE_OPCODES
+#define PROFILE_INSTRUCTION() profileInstruction(*ip)
+#else
+#define PROFILE_INSTRUCTION() do { } while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+    // 每个指令结束时直接跳转到下一条指令的处理代码，分支预测按指令位置区分
+    static void* dispatchTable[] = {
+#define OPCODE_LABEL(name) &&LABEL_##name,
+        OPCODE_LIST(OPCODE_LABEL)
+#undef OPCODE_LABEL
+    };
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(name) LABEL_##name
+#define DISPATCH() \
+    do { \
+        TRACE_INSTRUCTION(); \
+        PROFILE_INSTRUCTION(); \
+        goto *dispatchTable[READ_BYTE()]; \
+    } while (false)
+#else
+#define INTERPRET_LOOP \
+    loop: \
+        TRACE_INSTRUCTION(); \
+        PROFILE_INSTRUCTION(); \
+        switch (READ_BYTE())
+#define CASE(name) case name
+#define DISPATCH() goto loop
+#endif
+
+    LOAD_FRAME();
+
+    printf("\nrun\n");
+    INTERPRET_LOOP
+    {
+        CASE(OP_RETURN): {
+            Value result = POP();
+            // 栈帧开始的位置
+            closeUpvalues(slots);
+            vm.frameCount--;
+            if (vm.frameCount == 0) {
+                DROP();
+                vm.stackTop = stackTop;
+                return INTERPRET_OK;
             }
-            case OP_NEGATE:
-                if (!IS_NUMBER(peek(0))) {
-                    runtimeError("operand must be a number");
-                }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-            case OP_ADD:
-            {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                } else {
-                    runtimeError("Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+
+            stackTop = slots;
+            PUSH(result);
+            LOAD_FRAME();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_NEGATE):
+            if (!IS_NUMBER(PEEK(0))) {
+                RUNTIME_ERROR("operand must be a number");
             }
-                break;
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
-            case OP_CONSTANT:
-            {
-                // 变量声明必须位于括号内
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-            }
-            case OP_NIL:
-                push(NIL_VAL);break;
-            case OP_TRUE:
-                push(BOOL_VAL(true));break;
-            case OP_FALSE:
-                push(BOOL_VAL(false)); break;
-            case OP_NOT:
-                push(BOOL_VAL(isFalsey(pop())));
-                break;
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
-            }
-            case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
-            case OP_PRINT:
-                printValue(pop());
-                printf("\n");
-                break;
-            case OP_POP:
-                pop();
-                break;
-            case OP_DEFINE_GLOBAL: {
-                ObjString* name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
-                break;
-            }
-            case OP_GET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable %s", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(value);
-                break;
-            }
-            case OP_SET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                Value value;
-                if (tableSet(&vm.globals, name, value)) {
-                    tableDelete(&vm.globals, name) ;
-                    runtimeError("Undefined variable %s", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+            PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+            DISPATCH();
+        CASE(OP_ADD):
+        {
+            if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+                QUICKEN(OP_ADD_STR);
+                STORE_STATE();
+                concatenate();
+                LOAD_STACK();
+            } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                QUICKEN(OP_ADD_NUM);
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(POP());
+                PUSH(NUMBER_VAL(a + b));
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            }
+        }
+            DISPATCH();
+        CASE(OP_ADD_NUM): {
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                DEQUICKEN(OP_ADD);
+            }
+            double b = AS_NUMBER(POP());
+            PEEK(0) = NUMBER_VAL(AS_NUMBER(PEEK(0)) + b);
+            DISPATCH();
+        }
+        CASE(OP_ADD_STR): {
+            if (!IS_STRING(PEEK(0)) || !IS_STRING(PEEK(1))) {
+                DEQUICKEN(OP_ADD);
+            }
+            STORE_STATE();
+            concatenate();
+            LOAD_STACK();
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+        CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
+        CASE(OP_DIVIDE):   BINARY_OP(NUMBER_VAL, /); DISPATCH();
+        CASE(OP_CONSTANT):
+        {
+            // 变量声明必须位于括号内
+            Value constant = READ_CONSTANT();
+            PUSH(constant);
+            DISPATCH();
+        }
+        CASE(OP_NIL):
+            PUSH(NIL_VAL);DISPATCH();
+        CASE(OP_TRUE):
+            PUSH(BOOL_VAL(true));DISPATCH();
+        CASE(OP_FALSE):
+            PUSH(BOOL_VAL(false)); DISPATCH();
+        CASE(OP_NOT):
+            PEEK(0) = BOOL_VAL(isFalsey(PEEK(0)));
+            DISPATCH();
+        CASE(OP_EQUAL): {
+            if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                QUICKEN(OP_EQUAL_NUM);
+            }
+            Value b = POP();
+            Value a = POP();
+            PUSH(BOOL_VAL(valuesEqual(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_EQUAL_NUM): {
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                DEQUICKEN(OP_EQUAL);
+            }
+            double b = AS_NUMBER(POP());
+            PEEK(0) = BOOL_VAL(AS_NUMBER(PEEK(0)) == b);
+            DISPATCH();
+        }
+        CASE(OP_GREATER):  BINARY_OP(BOOL_VAL, >); DISPATCH();
+        CASE(OP_LESS):     BINARY_OP(BOOL_VAL, <); DISPATCH();
+        CASE(OP_PRINT):
+            printValue(POP());
+            printf("\n");
+            DISPATCH();
+        CASE(OP_POP):
+            DROP();
+            DISPATCH();
+        CASE(OP_DEFINE_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            vm.globalValues.values[slot] = POP();
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            Value value = vm.globalValues.values[slot];
+            if (IS_UNDEFINED(value)) {
+                RUNTIME_ERROR("Undefined variable %s", AS_CSTRING(vm.globalNames.values[slot]));
+            }
+            PUSH(value);
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+                RUNTIME_ERROR("Undefined variable %s", AS_CSTRING(vm.globalNames.values[slot]));
+            }
+            vm.globalValues.values[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            // assignment is an expression,
+            slots[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_CONSTANT_LONG):
+            PUSH(constants[READ_LONG()]);
+            DISPATCH();
+        CASE(OP_GET_LOCAL_LONG):
+            PUSH(slots[READ_LONG()]);
+            DISPATCH();
+        CASE(OP_SET_LOCAL_LONG):
+            slots[READ_LONG()] = PEEK(0);
+            DISPATCH();
+        CASE(OP_DEFINE_GLOBAL_LONG):
+            vm.globalValues.values[READ_LONG()] = POP();
+            DISPATCH();
+        CASE(OP_GET_GLOBAL_LONG): {
+            uint32_t slot = READ_LONG();
+            Value value = vm.globalValues.values[slot];
+            if (IS_UNDEFINED(value)) {
+                RUNTIME_ERROR("Undefined variable %s", AS_CSTRING(vm.globalNames.values[slot]));
+            }
+            PUSH(value);
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL_LONG): {
+            uint32_t slot = READ_LONG();
+            if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+                RUNTIME_ERROR("Undefined variable %s", AS_CSTRING(vm.globalNames.values[slot]));
+            }
+            vm.globalValues.values[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(PEEK(0))) {
+                ip += offset;
+            }
+            DISPATCH();
+        }
+        CASE(OP_ADD_R): {
+            uint8_t dst = READ_BYTE();
+            uint8_t mode = READ_BYTE();
+            Value b = READ_REGISTER(mode & REG_B_CONSTANT);
+            Value c = READ_REGISTER(mode & REG_C_CONSTANT);
+            if (IS_NUMBER(b) && IS_NUMBER(c)) {
+                Value result = NUMBER_VAL(AS_NUMBER(b) + AS_NUMBER(c));
+                if (mode & REG_DST_LOCAL) {
+                    slots[dst] = result;
+                } else {
+                    PUSH(result);
                 }
-                break;
-            }
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
-            }
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                // assignment is an expression,
-                frame->slots[slot] = peek(0);
-//                vm.stack[slot] = peek(0);
-                break;
-            }
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) {
-                    frame->ip += offset;
-//                    vm.ip += offset;
+            } else if (IS_STRING(b) && IS_STRING(c)) {
+                PUSH(b);
+                PUSH(c);
+                STORE_STATE();
+                concatenate();
+                LOAD_STACK();
+                if (mode & REG_DST_LOCAL) {
+                    slots[dst] = POP();
                 }
-                break;
-            }
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-//                vm.ip += offset;
-                break;
-            }
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-//                vm.ip -= offset;
-                frame->ip -= offset;
-                break;
-            }
-            case OP_CALL: {
-                int argCount = READ_BYTE();
-                if (!callValue(peek(argCount), argCount)) {
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            }
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT_R): REGISTER_BINARY_OP(NUMBER_VAL, -); DISPATCH();
+        CASE(OP_MULTIPLY_R): REGISTER_BINARY_OP(NUMBER_VAL, *); DISPATCH();
+        CASE(OP_DIVIDE_R):   REGISTER_BINARY_OP(NUMBER_VAL, /); DISPATCH();
+        CASE(OP_GREATER_R):  REGISTER_BINARY_OP(BOOL_VAL, >); DISPATCH();
+        CASE(OP_LESS_R):     REGISTER_BINARY_OP(BOOL_VAL, <); DISPATCH();
+        CASE(OP_EQUAL_R): {
+            uint8_t dst = READ_BYTE();
+            uint8_t mode = READ_BYTE();
+            Value b = READ_REGISTER(mode & REG_B_CONSTANT);
+            Value c = READ_REGISTER(mode & REG_C_CONSTANT);
+            if (mode & REG_DST_LOCAL) {
+                slots[dst] = BOOL_VAL(valuesEqual(b, c));
+            } else {
+                PUSH(BOOL_VAL(valuesEqual(b, c)));
+            }
+            DISPATCH();
+        }
+        CASE(OP_MOVE_R): {
+            uint8_t dst = READ_BYTE();
+            uint8_t mode = READ_BYTE();
+            slots[dst] = READ_REGISTER(mode & REG_B_CONSTANT);
+            DISPATCH();
+        }
+
+        CASE(OP_GET_LOCAL_CONSTANT): {
+            // OP_GET_LOCAL slot; OP_CONSTANT index
+            PUSH(slots[ip[0]]);
+            PUSH(constants[ip[2]]);
+            ip += 3;
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL_GET_LOCAL): {
+            // OP_GET_LOCAL slot; OP_GET_LOCAL slot
+            PUSH(slots[ip[0]]);
+            PUSH(slots[ip[2]]);
+            ip += 3;
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL_CONSTANT_LESS_JUMP): {
+            // OP_GET_LOCAL slot; OP_CONSTANT index; OP_LESS; OP_JUMP_IF_FALSE offset; OP_POP
+            Value a = slots[ip[0]];
+            Value b = constants[ip[2]];
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                // run the sequence one instruction at a time, OP_LESS reports the error
+                PUSH(a);
+                ip++;
+                DISPATCH();
+            }
+            if (AS_NUMBER(a) < AS_NUMBER(b)) {
+                // condition value is popped right away, skip OP_POP
+                ip += 8;
+            } else {
+                // jump target pops the condition value
+                uint16_t offset = (uint16_t)((ip[5] << 8) | ip[6]);
+                PUSH(BOOL_VAL(false));
+                ip += 7 + offset;
+            }
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL_POP): {
+            // OP_SET_LOCAL slot; OP_POP
+            slots[ip[0]] = POP();
+            ip += 2;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE_POP): {
+            // OP_JUMP_IF_FALSE offset; OP_POP
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(PEEK(0))) {
+                ip += offset;
+            } else {
+                DROP();
+                ip++;
+            }
+            DISPATCH();
+        }
+        CASE(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+            SAFEPOINT();
+#ifdef CLOX_JIT
+            JIT_COUNT(frame->closure->function);
+#endif
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_CALL): {
+            int argCount = READ_BYTE();
+            CallCache* cache = READ_CALL_CACHE();
+            SAFEPOINT();
+            Value callee = PEEK(argCount);
+            STORE_STATE();
+            if (callCached(cache, callee, argCount)) {
+#ifdef DEBUG_PROFILE_CALLS
+                callCacheHits++;
+#endif
+            } else {
+#ifdef DEBUG_PROFILE_CALLS
+                callCacheMisses++;
+#endif
+                // callValue may grow vm.frames, frame is stale after it
+                ObjFunction* caller = frame->closure->function;
+                if (!callValue(callee, argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
-            }
-            case OP_CLOSURE: {
-                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure* closure = newClosure(function);
-                push(OBJ_VAL(closure));
-
-                // 运行时捕获变量
-                for (int i = 0; i < closure->upvalueCount; i++) {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-
-                    if (isLocal) {
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
-                    } else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
-                }
-                break;
-            }
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-                break;
-            }
-            case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
-            }
-            case OP_CLOSE_UPVALUE:
-                closeUpvalues(vm.stackTop - 1);
-                pop();
-                break;
-
-            case OP_CLASS:
-                push(OBJ_VAL(newClass(READ_STRING())));
-                break;
-
-            case OP_METHOD:
-                defineMethod(READ_STRING());
-                break;
-
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(0))) {
-                    runtimeError("Only instances have properties.");
+                updateCallCache(caller, cache, callee);
+            }
+            LOAD_FRAME();
+            LOAD_STACK();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_TAIL_CALL): {
+            int argCount = READ_BYTE();
+            // the frame is reused, the call cache is left to OP_CALL
+            ip += 2;
+            SAFEPOINT();
+            Value callee = PEEK(argCount);
+            ObjClosure* closure = NULL;
+            if (IS_CLOSURE(callee)) {
+                closure = AS_CLOSURE(callee);
+            } else if (IS_BOUND_METHOD(callee)) {
+                closure = AS_BOUND_METHOD(callee)->method;
+                PEEK(argCount) = AS_BOUND_METHOD(callee)->receiver;
+            }
+
+            // 原生函数和类按普通调用处理，返回后执行之后的OP_RETURN
+            if (closure == NULL) {
+                STORE_STATE();
+                if (!callValue(callee, argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                LOAD_FRAME();
+                LOAD_STACK();
+                JIT_ENTER();
+                DISPATCH();
+            }
 
-                ObjString* name = READ_STRING();
-                ObjInstance* instance = AS_INSTANCE(peek(0));
-
-                Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop();
-                    push(value);
-                    break;
-                }
+            if (argCount != closure->function->arity) {
+                RUNTIME_ERROR("Expected %d arguments but got %d", closure->function->arity, argCount);
+            }
 
-                if (!bindMethod(instance->klass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            // 当前帧不再使用，关闭其中的upvalue后把被调用函数和参数移动到帧开始的位置，
+            // 复用当前的CallFrame
+            closeUpvalues(slots);
+            memmove(slots, stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+            vm.stackTop = slots + argCount + 1;
+            ensureStack((int)(slots - vm.stack) + closure->function->maxSlots + FRAME_STACK_SLACK);
+            frame->closure = closure;
+            frame->ip = closure->function->chunk.code;
+#ifdef CLOX_JIT
+            JIT_COUNT(closure->function);
+#endif
+            LOAD_FRAME();
+            LOAD_STACK();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_CLOSURE): {
+            ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+            STORE_STATE();
+            ObjClosure* closure = newClosure(function);
+            PUSH(OBJ_VAL(closure));
+            // closure is reachable from stack while upvalues are allocated
+            vm.stackTop = stackTop;
+
+            // 运行时捕获变量
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                uint8_t capture = READ_BYTE();
+                uint8_t index = READ_BYTE();
+                captureOperand(closure, i, capture, index, frame);
             }
+            DISPATCH();
+        }
+        CASE(OP_CLOSURE_LONG): {
+            ObjFunction* function = AS_FUNCTION(constants[READ_LONG()]);
+            STORE_STATE();
+            ObjClosure* closure = newClosure(function);
+            PUSH(OBJ_VAL(closure));
+            vm.stackTop = stackTop;
+
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                uint8_t capture = READ_BYTE();
+                uint32_t index = READ_LONG();
+                captureOperand(closure, i, capture, index, frame);
+            }
+            DISPATCH();
+        }
+        CASE(OP_GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            PUSH(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+            satbBarrier(*upvalue->location);
+            *upvalue->location = PEEK(0);
+            writeBarrier((Obj*)upvalue, PEEK(0));
+            DISPATCH();
+        }
+        CASE(OP_CLOSE_UPVALUE):
+            closeUpvalues(stackTop - 1);
+            DROP();
+            DISPATCH();
+
+        CASE(OP_CLASS): {
+            ObjString* name = READ_STRING();
+            STORE_STATE();
+            PUSH(OBJ_VAL(newClass(name)));
+            DISPATCH();
+        }
+        CASE(OP_CLASS_LONG): {
+            ObjString* name = READ_STRING_LONG();
+            STORE_STATE();
+            PUSH(OBJ_VAL(newClass(name)));
+            DISPATCH();
+        }
 
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) {
-                    runtimeError("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                ObjString* name = READ_STRING();
-                Value value = peek(0);
-                ObjInstance* instance = AS_INSTANCE(peek(1));
-
-                tableSet(&instance->fields, name, value);
-                pop();
-                pop();
-                push(value);
-                break;
-            }
-
-            case OP_INVOKE: {
-                // OP_INVOKE name argCount;
-                ObjString* name = READ_STRING();
-                uint8_t argCount = READ_BYTE();
-                if (!invoke(name, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount-1];
-                break;
+        CASE(OP_METHOD): {
+            ObjString* name = READ_STRING();
+            STORE_STATE();
+            defineMethod(name);
+            LOAD_STACK();
+            DISPATCH();
+        }
+        CASE(OP_METHOD_LONG): {
+            ObjString* name = READ_STRING_LONG();
+            STORE_STATE();
+            defineMethod(name);
+            LOAD_STACK();
+            DISPATCH();
+        }
+
+        CASE(OP_GET_PROPERTY): GET_PROPERTY(READ_STRING); DISPATCH();
+        CASE(OP_GET_PROPERTY_LONG): GET_PROPERTY(READ_STRING_LONG); DISPATCH();
+        CASE(OP_SET_PROPERTY): SET_PROPERTY(READ_STRING); DISPATCH();
+        CASE(OP_SET_PROPERTY_LONG): SET_PROPERTY(READ_STRING_LONG); DISPATCH();
+
+        CASE(OP_SET_PROPERTY_POP): {
+            // OP_SET_PROPERTY name cache; OP_POP
+            if (!IS_INSTANCE(PEEK(1))) {
+                RUNTIME_ERROR("Only instances have fields.");
             }
+            ObjString* name = READ_STRING();
+            InlineCache* cache = READ_CACHE();
+            Value value = PEEK(0);
+            ObjInstance* instance = AS_INSTANCE(PEEK(1));
+
+            STORE_STATE();
+            setCachedField(cache, instance, name, value);
+            stackTop -= 2;
+            ip++;
+            DISPATCH();
+        }
 
-            case OP_INHERIT: {
-                if (!IS_CLASS(peek(1))) {
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+        CASE(OP_INVOKE): {
+            // OP_INVOKE name argCount cache;
+            ObjString* name = READ_STRING();
+            uint8_t argCount = READ_BYTE();
+            InlineCache* cache = READ_CACHE();
+            STORE_STATE();
+            if (!invoke(name, argCount, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            LOAD_STACK();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_INVOKE_LONG): {
+            ObjString* name = READ_STRING_LONG();
+            uint8_t argCount = READ_BYTE();
+            InlineCache* cache = READ_CACHE();
+            STORE_STATE();
+            if (!invoke(name, argCount, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            LOAD_STACK();
+            JIT_ENTER();
+            DISPATCH();
+        }
 
-                ObjClass* superclass = AS_CLASS(peek(1));
-                ObjClass* subclass = AS_CLASS(peek(0));
-                tableAddAll(&superclass->methods, &subclass->methods);
-                pop(); // subclass
-                break;
+        CASE(OP_INHERIT): {
+            if (!IS_CLASS(PEEK(1))) {
+                RUNTIME_ERROR("Superclass must be a class.");
             }
 
-            case OP_GET_SUPER: {
-                ObjString* name = READ_STRING();
-                ObjClass* superClass = AS_CLASS(pop());
+            ObjClass* superclass = AS_CLASS(PEEK(1));
+            ObjClass* subclass = AS_CLASS(PEEK(0));
+            STORE_STATE();
+            tableAddAll(&superclass->methods, &subclass->methods);
+            writeBarrierTable((Obj*)subclass, &subclass->methods);
+            subclass->version++;
+            DROP(); // subclass
+            DISPATCH();
+        }
 
-                if (!bindMethod(superClass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+        CASE(OP_GET_SUPER): {
+            ObjString* name = READ_STRING();
+            ObjClass* superClass = AS_CLASS(POP());
+
+            STORE_STATE();
+            if (!bindMethod(superClass, name)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
+            LOAD_STACK();
+            DISPATCH();
+        }
+        CASE(OP_GET_SUPER_LONG): {
+            ObjString* name = READ_STRING_LONG();
+            ObjClass* superClass = AS_CLASS(POP());
 
-            case OP_SUPER_INVOKE: {
-                ObjString* method = READ_STRING();
-                int argCount = READ_BYTE();
-                ObjClass* superclass = AS_CLASS(pop());
-                if (!invokeFromClass(superclass, method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+            STORE_STATE();
+            if (!bindMethod(superClass, name)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
+            LOAD_STACK();
+            DISPATCH();
+        }
 
-            default:
-                break;
+        CASE(OP_SUPER_INVOKE): {
+            ObjString* method = READ_STRING();
+            int argCount = READ_BYTE();
+            ObjClass* superclass = AS_CLASS(POP());
+            STORE_STATE();
+            if (!invokeFromClass(superclass, method, argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            LOAD_STACK();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_SUPER_INVOKE_LONG): {
+            ObjString* method = READ_STRING_LONG();
+            int argCount = READ_BYTE();
+            ObjClass* superclass = AS_CLASS(POP());
+            STORE_STATE();
+            if (!invokeFromClass(superclass, method, argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            LOAD_STACK();
+            JIT_ENTER();
+            DISPATCH();
         }
     }
 
+    // only the switch dispatch can get here, for a byte that isn't an opcode
+    RUNTIME_ERROR("Unknown opcode.");
+
+#undef LOAD_FRAME
+#undef JIT_ENTER
+#undef SAFEPOINT
+#undef NURSERY_SAFEPOINT
+#undef COMPACT_SAFEPOINT
+#undef STORE_STATE
+#undef LOAD_STACK
+#undef PUSH
+#undef POP
+#undef DROP
+#undef PEEK
 #undef READ_BYTE
 #undef READ_CONSTANT
-#undef BINARY_OP
+#undef READ_STRING
 #undef READ_SHORT
+#undef READ_LONG
+#undef READ_STRING_LONG
+#undef READ_CACHE
+#undef READ_CALL_CACHE
+#undef QUICKEN
+#undef DEQUICKEN
+#undef RUNTIME_ERROR
+#undef BINARY_OP
+#undef READ_REGISTER
+#undef REGISTER_BINARY_OP
+#undef GET_PROPERTY
+#undef SET_PROPERTY
+#undef TRACE_INSTRUCTION
+#undef PROFILE_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
 }
@@ -7,8 +7,63 @@
 #include "table.h"
 #include "object.h"
 
-#define FRAME_MAX 64
-#define STACK_MAX (FRAME_MAX * UINT8_COUNT)
+// 调用帧和值栈从较小的容量开始按需增长，增长时重新分配并修正指向栈的指针
+#define FRAMES_INITIAL 8
+#define STACK_INITIAL UINT8_COUNT
+// 调用时在函数最多占用的栈槽之外保留的栈槽，用于vm执行一条指令的过程中临时压入的值，
+// 比如防止被回收的新对象和OP_ADD_R拼接字符串时的两个操作数
+#define FRAME_STACK_SLACK 8
+// 默认的最大调用深度，可以在编译时定义或者运行前修改vm.frameLimit
+#ifndef FRAME_LIMIT
+#define FRAME_LIMIT 100000
+#endif
+
+// 每个回收片段最多标记或者清除的对象数，0表示不分片一次完成回收，
+// 可以在编译时定义或者运行前修改vm.gcSliceBudget
+#ifndef GC_SLICE_BUDGET
+#define GC_SLICE_BUDGET 1000
+#endif
+
+#ifdef PARALLEL_MARK
+// 并行标记的线程数，包括主线程，可以在编译时定义或者运行前修改vm.gcMarkThreads
+#ifndef GC_MARK_THREADS
+#define GC_MARK_THREADS 4
+#endif
+#define GC_MARK_THREADS_MAX 64
+#endif
+
+// 老年代对象按大小分类，第i类的单元为(i + 1) * HEAP_CELL_ALIGN字节，分配在memory.c的页中
+#define HEAP_CELL_ALIGN 16
+#define HEAP_SIZE_CLASSES 16
+
+typedef struct Page Page;
+
+typedef struct {
+    // 已经清除的和本轮新分配的页
+    Page* pages;
+    // pages中还有空闲单元的页
+    Page* freePages;
+    // 本轮还没有清除的页
+    Page* sweepPages;
+} SizeClass;
+
+#ifdef COMPACT_GC
+// 完整回收后存活对象占用的页空间低于这个百分比时整理堆，0表示只在调用compactHeap()时整理，
+// 可以在编译时定义或者运行前修改vm.compactThreshold
+#ifndef COMPACT_THRESHOLD
+#define COMPACT_THRESHOLD 50
+#endif
+// 页数少于这个值时不自动整理
+#define COMPACT_MIN_PAGES 64
+#endif
+
+typedef enum {
+    GC_IDLE,
+    // 灰色对象分片标记，标记结束时重新标记根并一次完成
+    GC_MARK,
+    // sweepPages中的页分片清除，分配时也会先清除同一类的页
+    GC_SWEEP,
+} GcPhase;
 
 typedef struct {
     ObjClosure* closure;
@@ -17,25 +72,64 @@ typedef struct {
 } CallFrame;
 
 typedef struct {
-    CallFrame frames[FRAME_MAX];
+    CallFrame* frames;
     int frameCount;
+    int frameCapacity;
+    int frameLimit;
 
 	Chunk* chunk;
 	uint8_t* ip;
-	Value stack[STACK_MAX];
+	Value* stack;
 	Value* stackTop;
-    Obj* objects;
+	int stackCapacity;
+    SizeClass sizeClasses[HEAP_SIZE_CLASSES];
     Table strings;
+    // global variables are resolved to slots at compile time,
+    // globals maps a name to its slot in globalValues and globalNames
     Table globals;
+    ValueArray globalValues;
+    ValueArray globalNames;
 
     ObjString* initString;
 
-    ObjUpvalue* openValues;
+    // shape of instances without any field, root of the shape transition tree
+    ObjShape* rootShape;
+
+    // 按栈槽索引的打开的upvalue，和值栈同样大小，
+    // 下标openTop及以上的栈槽都没有打开的upvalue
+    ObjUpvalue** openUpvalues;
+    int openTop;
 
     int grayCount;
     int grayCapacity;
     Obj** grayStack;
 
+    GcPhase gcPhase;
+    int gcSliceBudget;
+#ifdef PARALLEL_MARK
+    // 大于1时每轮回收开始时由这么多线程一次完成标记
+    int gcMarkThreads;
+#endif
+
+#ifdef COMPACT_GC
+    int compactThreshold;
+    // 在下一个安全点整理堆
+    bool compactRequested;
+#endif
+
+#ifdef GENERATIONAL_GC
+    // 新对象按指针递增分配在nursery中，用完后分配到老年代并在下一个安全点回收新生代
+    uint8_t* nursery;
+    uint8_t* nurseryTop;
+    // 新生代对象的标记位图，见memory.h
+    uint64_t* nurseryMarks;
+    bool nurseryFull;
+    // 可能引用新生代对象的老年代对象，新生代回收时作为根
+    Obj** remembered;
+    int rememberedCount;
+    int rememberedCapacity;
+#endif
+
     size_t bytesAllocated;
     size_t nextGC;
 } VM;
@@ -55,6 +149,14 @@ typedef enum {
 InterpertResult interpret(const char* source);
 
 
+int globalSlot(ObjString* name);
+
+#ifdef CLOX_JIT
+bool jitGetProperty(CallFrame* frame, Value* stackTop, int offset);
+
+bool jitSetProperty(CallFrame* frame, Value* stackTop, int offset);
+#endif
+
 void push(Value value);
 
 Value pop();